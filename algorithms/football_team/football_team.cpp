@@ -1,11 +1,17 @@
 #include <algorithm>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <list>
 #include <numeric>
+#include <random>
 #include <vector>
 #include <utility>
 #include <string>
 
+#include "../testing/test_harness.h"
+
 using std::cin;
 using std::copy;
 using std::cout;
@@ -103,44 +109,108 @@ private:
     long long efficiency_;
 };
 
-// Sorts elements in interval [bwgin, end),
-// the array elements compare with `comp`. 
+// The length of the runs sorted by insertion before they are merged.
+const size_t SORT_RUN_LENGTH = 16;
+
+// Sorts elements in interval [begin, end) by insertion, keeping the order
+// of the equal elements.
 template <typename Iterator, typename Comparator>
-void Sort(Iterator begin, Iterator end, Comparator cmp) {
-    size_t length = distance(begin, end);
-    if (length < 2) {
+void InsertionSort(Iterator begin, Iterator end, Comparator cmp) {
+    if (begin == end) {
         return;
     }
+    for (Iterator current = next(begin); current != end; ++current) {
+        auto value = std::move(*current);
+        Iterator hole = current;
+        for (Iterator previous = prev(hole); cmp(value, *previous); --previous) {
+            *hole = std::move(*previous);
+            hole = previous;
+            if (previous == begin) {
+                break;
+            }
+        }
+        *hole = std::move(value);
+    }
+}
 
-    size_t middle = length / 2;
-    Iterator pivot = next(begin, middle);
+// Merges sorted intervals [begin, pivot) and [pivot, end) keeping the order
+// of the equal elements. The shorter interval is moved to `buffer`, which
+// must have the capacity for it, so the merge doesn't allocate.
+template <typename Iterator, typename Comparator>
+void Merge(Iterator begin, Iterator pivot, Iterator end,
+           vector<typename iterator_traits<Iterator>::value_type>& buffer, Comparator cmp) {
+    if (begin == pivot || pivot == end || !cmp(*pivot, *prev(pivot))) {
+        return;
+    }
 
-    Sort(begin, pivot, cmp);
-    Sort(pivot, end, cmp);
-    Merge(begin, pivot, end, cmp);
+    buffer.clear();
+    if (distance(begin, pivot) <= distance(pivot, end)) {
+        std::move(begin, pivot, std::back_inserter(buffer));
+        auto firstIter = buffer.begin();
+        Iterator secondIter = pivot;
+        while (firstIter != buffer.end()) {
+            if (secondIter == end) {
+                std::move(firstIter, buffer.end(), begin);
+                return;
+            }
+            if (cmp(*secondIter, *firstIter)) {
+                *begin = std::move(*secondIter++);
+            } else {
+                *begin = std::move(*firstIter++);
+            }
+            ++begin;
+        }
+    } else {
+        std::move(pivot, end, std::back_inserter(buffer));
+        Iterator firstIter = pivot;
+        auto secondIter = buffer.end();
+        while (secondIter != buffer.begin()) {
+            if (firstIter == begin) {
+                std::move_backward(buffer.begin(), secondIter, end);
+                return;
+            }
+            if (cmp(*prev(secondIter), *prev(firstIter))) {
+                *--end = std::move(*--firstIter);
+            } else {
+                *--end = std::move(*--secondIter);
+            }
+        }
+    }
 }
 
+// Sorts elements in interval [begin, end) keeping the order of the equal
+// elements, the array elements compare with `comp`. The runs of
+// `SORT_RUN_LENGTH` elements are sorted by insertion and then merged
+// bottom-up through one buffer of a half of the length.
 template <typename Iterator, typename Comparator>
-void Merge(Iterator begin, Iterator pivot, Iterator end, Comparator cmp) {
-    vector<typename iterator_traits<Iterator>::value_type> firstPart(begin, pivot);
-    vector<typename iterator_traits<Iterator>::value_type> secondPart(pivot, end);
-
-    Iterator firstIter = firstPart.begin();
-    Iterator secondIter = secondPart.begin();
+void Sort(Iterator begin, Iterator end, Comparator cmp) {
+    size_t length = distance(begin, end);
+    Iterator runBegin = begin;
+    for (size_t left = length; left > 0; ) {
+        size_t runLength = std::min(SORT_RUN_LENGTH, left);
+        Iterator runEnd = next(runBegin, runLength);
+        InsertionSort(runBegin, runEnd, cmp);
+        runBegin = runEnd;
+        left -= runLength;
+    }
+    if (length <= SORT_RUN_LENGTH) {
+        return;
+    }
 
-    while (firstIter != firstPart.end()) {
-        if (secondIter == secondPart.end()) {
-            copy(firstIter, firstPart.end(), begin);
-            return;
+    vector<typename iterator_traits<Iterator>::value_type> buffer;
+    buffer.reserve(length / 2);
+    for (size_t width = SORT_RUN_LENGTH; width < length; width *= 2) {
+        runBegin = begin;
+        size_t left = length;
+        while (left > width) {
+            size_t runLength = std::min(2 * width, left);
+            Iterator pivot = next(runBegin, width);
+            Iterator runEnd = next(pivot, runLength - width);
+            Merge(runBegin, pivot, runEnd, buffer, cmp);
+            runBegin = runEnd;
+            left -= runLength;
         }
-        if (cmp(*secondIter, *firstIter)) {
-            *begin = *secondIter++;
-        } else {
-            *begin = *firstIter++;
-        }
-        ++begin;
     }
-    copy(secondIter, secondPart.end(), begin);
 }
 
 // Represents a team.
@@ -226,12 +296,63 @@ vector<Player> ReadInput() {
     return players;
 }
 
+// Returns the milliseconds `sort` takes on `count` Players with random
+// efficiencies, already ordered by efficiency if `sorted`, summed over
+// enough repeats to sort ten million Players.
+template <class SortFunction>
+double BenchmarkSort(size_t count, bool sorted, SortFunction sort) {
+    std::mt19937 random(1);
+    vector<Player> input(count);
+    for (size_t i = 0; i < count; ++i) {
+        input[i] = Player{ (long long)(random() % count), (unsigned int)(i + 1) };
+    }
+    if (sorted) {
+        std::stable_sort(input.begin(), input.end(), CompareByEfficiency);
+    }
+
+    const size_t repeats = std::max<size_t>(10000000 / count, 1);
+    std::chrono::steady_clock::duration elapsed(0);
+    for (size_t repeat = 0; repeat < repeats; ++repeat) {
+        vector<Player> players = input;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        sort(players);
+        elapsed += std::chrono::steady_clock::now() - start;
+    }
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+// Prints the times of `Sort` and `std::stable_sort` on Players arrays.
+void BenchmarkSortAll() {
+    cout << "players\torder\tSort, ms\tstd::stable_sort, ms" << endl;
+    for (size_t count = 100; count <= 10000000; count *= 10) {
+        for (bool sorted : { false, true }) {
+            double mergeSort = BenchmarkSort(count, sorted, [](vector<Player>& players) {
+                Sort(players.begin(), players.end(), CompareByEfficiency);
+            });
+            double stableSort = BenchmarkSort(count, sorted, [](vector<Player>& players) {
+                std::stable_sort(players.begin(), players.end(), CompareByEfficiency);
+            });
+            cout << count << '\t' << (sorted ? "sorted" : "random") << '\t'
+                 << std::fixed << std::setprecision(1) << mergeSort << '\t' << stableSort << endl;
+        }
+    }
+}
+
 // Launches all tests.
 void TestAll();
 
 int main(int argc, char *argv[]) {
-    if (argc == 2 && std::string(argv[1]) == "--test") {
+    if (argc >= 2 && std::string(argv[1]) == "--test") {
+        if (!ParseTestArguments(argc, argv, 2)) {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--test [--test-seed <seed>] [--test-threads <count>]"
+                      << " [--test-iterations <count>]] | [--benchmark]"
+                      << endl;
+            return 1;
+        }
         TestAll();
+    } else if (argc == 2 && std::string(argv[1]) == "--benchmark") {
+        BenchmarkSortAll();
     } else {
         vector<Player> players;
         players = ReadInput();
@@ -280,12 +401,6 @@ void TestSort(vector<T> input, vector<T> expected, Compare comp) {
     CheckResult(input, result, expected, "Sort");
 }
 
-// Returns a random number from the range.
-int Random(int rangeMin, int rangeMax) {
-    int rangeSize = rangeMax - rangeMin + 1;
-    return rangeMin + rand() % rangeSize;
-}
-
 // Tests the `Sort` at arrays of random numbers.
 // The numbers generated by the `Random` function.
 void StressTestSortNumbers(int maxLength, int maxItemAbs) {
@@ -298,21 +413,24 @@ void StressTestSortNumbers(int maxLength, int maxItemAbs) {
     std::sort(answer.begin(), answer.end());
     vector<int> result = input;
     Sort(result.begin(), result.end(), less<>());
-
     CheckResult(input, result, answer, "Sort");
+
+    std::list<int> list(input.begin(), input.end());
+    Sort(list.begin(), list.end(), less<>());
+    CheckResult(input, vector<int>(list.begin(), list.end()), answer, "Sort of std::list");
 }
 
-// Tests the `Sort` at arrays of random Players.
+// Tests the `Sort` at arrays of random Players against `std::stable_sort`.
 // The Players generated by the `Random` function.
 template<class Compare>
 void StressTestSortPlayers(int maxLength, int maxItem, Compare cmp) {
     vector<Player> input(Random(1, maxLength));
     for (size_t i = 0; i < input.size(); ++i) {
-        input[i] = Player{ Random(0, maxItem), Random(0, maxItem) };
+        input[i] = Player{ Random(0, maxItem), (unsigned int)Random(0, maxItem) };
     }
 
     vector<Player> answer = input;
-    std::sort(answer.begin(), answer.end(), cmp);
+    std::stable_sort(answer.begin(), answer.end(), cmp);
     vector<Player> result = input;
     Sort(result.begin(), result.end(), cmp);
 
@@ -333,17 +451,14 @@ void TestSortNumbers() {
     TestSort(vector<int>{}, vector<int>{}, less<>());
     TestSort(vector<int>(100, 5), vector<int>(100, 5), less<>());
 
-    srand(21102014);
     const size_t smallTestCount = 1000;
-    for (size_t testNum = 1; testNum <= smallTestCount; ++testNum) {
-        cout << "Test " << testNum << endl;
+    RunStressTest("StressTestSortNumbers", 21102014, smallTestCount, [&] {
         StressTestSortNumbers(10, 10);
-    }
+    });
     const size_t bigTestCount = 1000000;
-    for (size_t testNum = smallTestCount + 1; testNum <= bigTestCount; ++testNum) {
-        cout << "Test " << testNum << endl;
+    RunStressTest("StressTestSortNumbers", 21102014, bigTestCount - smallTestCount, [&] {
         StressTestSortNumbers(100, 1000);
-    }
+    });
 }
 
 // Launches the `TestSort` function with different input Players.
@@ -394,35 +509,35 @@ void TestSortPlayers() {
              vector<P>{ }, 
              CompareById);
 
-    srand(21102014);
+    // Leaves the Players of equal efficiencies to check the stability.
+    auto compareEfficiencies = [](const P& first, const P& second) {
+        return first.efficiency < second.efficiency;
+    };
     const size_t smallTestCount = 1000;
-    for (size_t testNum = 1; testNum <= smallTestCount; ++testNum) {
-        cout << "Test " << testNum << endl;
+    RunStressTest("StressTestSortPlayers", 21102014, smallTestCount, [&] {
         StressTestSortPlayers(10, 10, CompareByEfficiency);
         StressTestSortPlayers(10, 10, CompareById);
-    }
+        StressTestSortPlayers(10, 3, compareEfficiencies);
+    });
     const size_t bigTestCount = 1000000;
-    for (size_t testNum = smallTestCount + 1; testNum <= bigTestCount; ++testNum) {
-        cout << "Test " << testNum << endl;
+    RunStressTest("StressTestSortPlayers", 21102014, bigTestCount - smallTestCount, [&] {
         StressTestSortPlayers(100, 1000, CompareByEfficiency);
         StressTestSortPlayers(100, 1000, CompareById);
-    }
+        StressTestSortPlayers(100, 10, compareEfficiencies);
+    });
 }
 
 // Launches tests of `Sort` function on different data types.
 void TestSortAll() {
-    cout << "Testing Sort with array of numbers: " << endl;
-    TestSortNumbers();
-
-    cout << "Testing Sort with array of Players: " << endl;
-    TestSortPlayers();
+    RunTestSuite("Sort with array of numbers", TestSortNumbers);
+    RunTestSuite("Sort with array of Players", TestSortPlayers);
 }
 
 // Tests the `createTeam` function of the `Team` class.
 void TestTeamCreate(vector<int> input, vector<int> expected) {
     vector<Player> players(input.size());
-    for (int i = 0; i < input.size(); ++i) {
-        players[i] = Player{ input[i], i + 1 };
+    for (size_t i = 0; i < input.size(); ++i) {
+        players[i] = Player{ input[i], (unsigned int)(i + 1) };
     }
 
     Team idealTeam = buildMaxEfficiencyTeam(players);
@@ -432,7 +547,6 @@ void TestTeamCreate(vector<int> input, vector<int> expected) {
 
 // Launches the `TestTeamCreate` function with different input.
 void TestTeamCreateAll() {
-    cout << "Testing createTeam method: " << endl;
     TestTeamCreate({ 3, 2, 5, 4, 1 }, { 1, 2, 3, 4 });
     TestTeamCreate({ 1, 2, 4, 8, 16 }, { 4, 5 });
     TestTeamCreate({ 1, 5, 2, 3, 4, 9, 6, 2, 1, 3 }, { 2, 5, 6, 7 });
@@ -442,5 +556,5 @@ void TestTeamCreateAll() {
 
 void TestAll() {
     TestSortAll();
-    TestTeamCreateAll();
+    RunTestSuite("createTeam method", TestTeamCreateAll);
 }
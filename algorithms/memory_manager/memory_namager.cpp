@@ -1,62 +1,486 @@
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <functional>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
-#include <list>
+#include <limits>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <random>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 #include <utility>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../testing/test_harness.h"
+
 using std::cerr;
 using std::cin;
 using std::cout;
 using std::endl;
 using std::greater;
-using std::istream;
 using std::iterator_traits;
-using std::list;
-using std::make_heap;
 using std::next;
+using std::pair;
 using std::ostream;
 using std::string;
 using std::runtime_error;
 using std::swap;
 using std::vector;
 
+// Sizes and offsets of the memory, in cells.
+typedef int64_t MemorySize;
+
 const int OUT_OF_HEAP = -1;
-const int FAIL_CODE = -1;
+// The offset returned when there is no memory for an allocation.
+const MemorySize FAIL_CODE = -1;
+const unsigned int NO_OPERATION = 0;
+// The memory parts keep the sizes and the offsets in 48 bits
+// and the indices in 29 bits, see `MemoryPart`.
+const MemorySize MAX_MEMORY_SIZE = (MemorySize(1) << 47) - 1;
+const int MAX_PART_INDEX = (1 << 28) - 1;
 
 enum MemoryState {
     IS_FREE,
-    IS_OCCUPIED
+    IS_OCCUPIED,
+    // Revoked, but kept in the free list of its size class.
+    IS_CACHED,
+    // Revoked, but not merged with the free neighbours yet.
+    IS_PENDING,
+    // Free, but moved by the compaction instead of being allocated.
+    IS_COMPACTING
 };
 
 enum RequestType {
     ALLOCATION = 1,
-    REVOCATION = 2
+    REVOCATION = 2,
+    REALLOCATION = 3
 };       
 
-struct MemoryPart {
-    int size;
-    int offset;
-    int index;
-    MemoryState state;
+// In the raw encoding of the requests, a non-negative number is the size
+// of an allocation, a negative one is the number of the revoked request,
+// and `REALLOCATION_CODE` is followed by the number of the reallocated
+// request and the new size.
+const int REALLOCATION_CODE = std::numeric_limits<int>::min();
+const size_t REALLOCATION_LENGTH = 3;
+
+// Returns the count of the numbers of the raw request starting with `rawRequest`.
+inline size_t RawRequestLength(int rawRequest) {
+    return rawRequest == REALLOCATION_CODE ? REALLOCATION_LENGTH : 1;
+}
+
+inline bool IsRevocation(int rawRequest) {
+    return rawRequest < 0 && rawRequest != REALLOCATION_CODE;
+}
+
+typedef unsigned int MemoryPartHandle;
+
+const MemoryPartHandle NO_MEMORY_PART = 0xFFFFFFFF;
+
+class InvalidSnapshotException : public runtime_error {
+public:
+    InvalidSnapshotException()
+        : runtime_error("the snapshot is truncated or was written by another configuration")
+    {}
+};
+
+// Writes a snapshot as a sequence of arrays of trivially copyable values in
+// the native byte order. Every array starts at a multiple of 8 bytes, so a
+// mapped snapshot can be read in place.
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(FILE* file)
+        : file_(file),
+          failed_(false)
+    {}
+
+    template <class T>
+    void write(const T* values, size_t count) {
+        static_assert(std::is_trivially_copyable<T>::value, "values are copied bytewise");
+        size_t size = sizeof(T) * count;
+        const char padding[ALIGNMENT] = {};
+        if (size > 0) {
+            failed_ = failed_ || std::fwrite(values, 1, size, file_) != size ||
+                      std::fwrite(padding, 1, paddingOf(size), file_) != paddingOf(size);
+        }
+    }
+
+    template <class T>
+    void writeValue(const T& value) {
+        write(&value, 1);
+    }
+
+    template <class T, class Allocator>
+    void writeVector(const vector<T, Allocator>& values) {
+        writeValue(uint64_t(values.size()));
+        write(values.data(), values.size());
+    }
+
+    bool failed() const {
+        return failed_;
+    }
+
+    static const size_t ALIGNMENT = 8;
+
+    static size_t paddingOf(size_t size) {
+        return (ALIGNMENT - size % ALIGNMENT) % ALIGNMENT;
+    }
+
+private:
+    FILE* file_;
+    bool failed_;
+};
+
+// Reads a snapshot written by `SnapshotWriter` from the memory [begin, end).
+// Throws `InvalidSnapshotException` if the snapshot is too short or `check`
+// fails.
+class SnapshotReader {
+public:
+    SnapshotReader(const char* begin, const char* end)
+        : position_(begin),
+          end_(end)
+    {}
+
+    template <class T>
+    void read(T* values, size_t count) {
+        static_assert(std::is_trivially_copyable<T>::value, "values are copied bytewise");
+        if (count > size_t(end_ - position_) / sizeof(T)) {
+            throw InvalidSnapshotException();
+        }
+        size_t size = sizeof(T) * count;
+        if (size > 0) {
+            std::memcpy(static_cast<void*>(values), position_, size);
+        }
+        position_ += std::min(size + SnapshotWriter::paddingOf(size), size_t(end_ - position_));
+    }
+
+    template <class T>
+    T readValue() {
+        T value;
+        read(&value, 1);
+        return value;
+    }
+
+    template <class T, class Allocator>
+    void readVector(vector<T, Allocator>& values) {
+        uint64_t count = readValue<uint64_t>();
+        if (count > uint64_t(end_ - position_) / sizeof(T)) {
+            throw InvalidSnapshotException();
+        }
+        values.resize(count);
+        read(values.data(), count);
+    }
+
+    // Throws unless `value` equals the next value.
+    template <class T>
+    void expect(const T& value) {
+        check(readValue<T>() == value);
+    }
+
+    // Throws unless the loaded values are `valid`.
+    void check(bool valid) const {
+        if (!valid) {
+            throw InvalidSnapshotException();
+        }
+    }
+
+private:
+    const char* position_;
+    const char* end_;
+};
+
+// Takes 24 bytes: the size and the offset are packed into 48-bit fields
+// and the state into the spare bits of the index.
+struct __attribute__((packed)) MemoryPart {
+    MemorySize size : 48;
+    MemorySize offset : 48;
+    // Position of a free part in the placement index.
+    int index : 29;
+    MemoryState state : 3;
+    // Neighbours in the `MemoryPartList`.
+    MemoryPartHandle prev;
+    MemoryPartHandle next;
 
     MemoryPart()
         : index(OUT_OF_HEAP),
-          state(IS_FREE)
+          state(IS_FREE),
+          prev(NO_MEMORY_PART),
+          next(NO_MEMORY_PART)
     {}
 
-    MemoryPart(int size, int offset, int index, MemoryState state)
+    MemoryPart(MemorySize size, MemorySize offset, int index, MemoryState state)
         : size(size),
           offset(offset),
           index(index),
-          state(state)
+          state(state),
+          prev(NO_MEMORY_PART),
+          next(NO_MEMORY_PART)
+    {}
+};
+
+static_assert(sizeof(MemoryPart) == 24, "MemoryPart must stay 24 bytes");
+
+// Doubly linked list of memory parts stored in one contiguous pool.
+// The nodes are linked by 32-bit handles (indices in the pool), and the
+// erased nodes are kept in a free list and reused, so the list allocates
+// only when it grows beyond its largest size so far.
+class MemoryPartList {
+public:
+    class iterator {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef MemoryPart value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef MemoryPart* pointer;
+        typedef MemoryPart& reference;
+
+        iterator()
+            : list_(nullptr),
+              handle_(NO_MEMORY_PART)
+        {}
+
+        iterator(MemoryPartList* list, MemoryPartHandle handle)
+            : list_(list),
+              handle_(handle)
+        {}
+
+        MemoryPart& operator*() const {
+            return list_->nodes_[handle_];
+        }
+
+        MemoryPart* operator->() const {
+            return &list_->nodes_[handle_];
+        }
+
+        iterator& operator++() {
+            handle_ = list_->nodes_[handle_].next;
+            return *this;
+        }
+
+        iterator& operator--() {
+            if (handle_ == NO_MEMORY_PART) {
+                handle_ = list_->last_;
+            } else {
+                handle_ = list_->nodes_[handle_].prev;
+            }
+            return *this;
+        }
+
+        bool operator==(const iterator& other) const {
+            return handle_ == other.handle_;
+        }
+
+        bool operator!=(const iterator& other) const {
+            return handle_ != other.handle_;
+        }
+
+        MemoryPartHandle handle() const {
+            return handle_;
+        }
+
+    private:
+        MemoryPartList* list_;
+        MemoryPartHandle handle_;
+    };
+
+    explicit MemoryPartList(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : nodes_(resource),
+          first_(NO_MEMORY_PART),
+          last_(NO_MEMORY_PART),
+          freeNodes_(NO_MEMORY_PART)
     {}
+
+    // Iterators keep a pointer to the list, so it must not be copied.
+    MemoryPartList(const MemoryPartList&) = delete;
+    MemoryPartList& operator=(const MemoryPartList&) = delete;
+
+    iterator begin() {
+        return iterator(this, first_);
+    }
+
+    iterator end() {
+        return iterator(this, NO_MEMORY_PART);
+    }
+
+    iterator at(MemoryPartHandle handle) {
+        return iterator(this, handle);
+    }
+
+    // Returns `true` if the handle refers to a node, listed or erased.
+    bool isHandle(MemoryPartHandle handle) const {
+        return handle < nodes_.size();
+    }
+
+    // The number of the nodes, listed and erased.
+    size_t capacity() const {
+        return nodes_.size();
+    }
+
+    void push_back(const MemoryPart& part) {
+        insert(end(), part);
+    }
+
+    void save(SnapshotWriter& writer) const {
+        writer.writeValue(first_);
+        writer.writeValue(last_);
+        writer.writeValue(freeNodes_);
+        writer.writeVector(nodes_);
+    }
+
+    // Throws `InvalidSnapshotException` unless every node is either in
+    // the list of the adjacent parts or in the list of the erased nodes.
+    void load(SnapshotReader& reader) {
+        first_ = reader.readValue<MemoryPartHandle>();
+        last_ = reader.readValue<MemoryPartHandle>();
+        freeNodes_ = reader.readValue<MemoryPartHandle>();
+        reader.readVector(nodes_);
+        reader.check(nodes_.size() <= size_t(MAX_PART_INDEX) + 1 && linksValid());
+    }
+
+    // Calls `visit` for every part in order.
+    template <class Visitor>
+    void forEach(Visitor visit) const {
+        for (MemoryPartHandle handle = first_; handle != NO_MEMORY_PART; handle = nodes_[handle].next) {
+            visit(nodes_[handle]);
+        }
+    }
+
+    // Hints the processor to load the part and its neighbours into the cache.
+    void prefetch(MemoryPartHandle handle) const {
+        const MemoryPart& part = nodes_[handle];
+        __builtin_prefetch(&part);
+        if (part.prev != NO_MEMORY_PART) {
+            __builtin_prefetch(&nodes_[part.prev]);
+        }
+        if (part.next != NO_MEMORY_PART) {
+            __builtin_prefetch(&nodes_[part.next]);
+        }
+    }
+
+    // Inserts `part` before `position`.
+    // Returns the iterator to the inserted part.
+    iterator insert(iterator position, const MemoryPart& part) {
+        MemoryPartHandle handle = allocateNode(part);
+        MemoryPartHandle next = position.handle();
+        MemoryPartHandle prev = next == NO_MEMORY_PART ? last_ : nodes_[next].prev;
+
+        nodes_[handle].prev = prev;
+        nodes_[handle].next = next;
+        if (prev == NO_MEMORY_PART) {
+            first_ = handle;
+        } else {
+            nodes_[prev].next = handle;
+        }
+        if (next == NO_MEMORY_PART) {
+            last_ = handle;
+        } else {
+            nodes_[next].prev = handle;
+        }
+
+        return iterator(this, handle);
+    }
+
+    // Erases the part at `position`.
+    // Returns the iterator to the following part.
+    iterator erase(iterator position) {
+        MemoryPartHandle handle = position.handle();
+        MemoryPartHandle prev = nodes_[handle].prev;
+        MemoryPartHandle next = nodes_[handle].next;
+
+        if (prev == NO_MEMORY_PART) {
+            first_ = next;
+        } else {
+            nodes_[prev].next = next;
+        }
+        if (next == NO_MEMORY_PART) {
+            last_ = prev;
+        } else {
+            nodes_[next].prev = prev;
+        }
+
+        nodes_[handle].next = freeNodes_;
+        freeNodes_ = handle;
+        return iterator(this, next);
+    }
+
+private:
+    // Walks both lists in O(n), every node must be met once.
+    bool linksValid() const {
+        vector<char> met(nodes_.size(), false);
+        MemoryPartHandle prev = NO_MEMORY_PART;
+        for (MemoryPartHandle handle = first_; handle != NO_MEMORY_PART; handle = nodes_[handle].next) {
+            if (handle >= nodes_.size() || met[handle]) {
+                return false;
+            }
+            const MemoryPart& part = nodes_[handle];
+            if (part.prev != prev || static_cast<unsigned>(part.state) > IS_COMPACTING ||
+                part.size < 0 || part.offset < 0 ||
+                (prev != NO_MEMORY_PART && part.offset != nodes_[prev].offset + nodes_[prev].size)) {
+                return false;
+            }
+            met[handle] = true;
+            prev = handle;
+        }
+        if (prev != last_) {
+            return false;
+        }
+
+        for (MemoryPartHandle handle = freeNodes_; handle != NO_MEMORY_PART; handle = nodes_[handle].next) {
+            if (handle >= nodes_.size() || met[handle]) {
+                return false;
+            }
+            met[handle] = true;
+        }
+        return std::find(met.begin(), met.end(), false) == met.end();
+    }
+
+    // Throws `std::length_error` if the handle wouldn't fit in the index
+    // of a part, which links the cached parts.
+    MemoryPartHandle allocateNode(const MemoryPart& part) {
+        if (freeNodes_ == NO_MEMORY_PART) {
+            if (nodes_.size() > size_t(MAX_PART_INDEX)) {
+                throw std::length_error("the memory parts exceed MAX_PART_INDEX");
+            }
+            nodes_.push_back(part);
+            return nodes_.size() - 1;
+        }
+
+        MemoryPartHandle handle = freeNodes_;
+        freeNodes_ = nodes_[handle].next;
+        nodes_[handle] = part;
+        return handle;
+    }
+
+    std::pmr::vector<MemoryPart> nodes_;
+    MemoryPartHandle first_;
+    MemoryPartHandle last_;
+    // Head of the list of the erased nodes, linked by `next`.
+    MemoryPartHandle freeNodes_;
 };
 
-typedef list<MemoryPart>::iterator MemoryPartIterator;
+typedef MemoryPartList::iterator MemoryPartIterator;
 
 class CompareMemoryPartsBySize {
 public:
@@ -68,14 +492,17 @@ public:
     }
 };
 
-void SwapMemoryPartIterators(MemoryPartIterator& first, MemoryPartIterator& second) {
-    if (first->index == second->index) {
-        return;
+// Position tracking policy of `Heap` keeping the positions in `index`.
+class MemoryPartPositions {
+public:
+    int get(const MemoryPartIterator& part) const {
+        return part->index;
     }
 
-    swap(first->index, second->index);
-    swap(first, second);
-}
+    void set(const MemoryPartIterator& part, int position) const {
+        part->index = position;
+    }
+};
 
 class EmptyHeapException : public runtime_error {
 public:
@@ -84,13 +511,6 @@ public:
     {}
 };
 
-class MethodNotOverridenException : public runtime_error {
-public:
-    MethodNotOverridenException()
-        : runtime_error("the method must be overriden")
-    {}
-};
-
 class UnknownRequestTypeException : public runtime_error {
 public:
     UnknownRequestTypeException()
@@ -98,24 +518,44 @@ public:
     {}
 };
 
+// Position tracking policy of `Heap` for elements which don't need it.
+template <class T>
+class IgnorePositions {
+public:
+    void set(const T& /* element */, int /* position */) const {}
+};
+
+// Indexed priority queue. `Positions::set(element, position)` is called
+// whenever an element is placed, with `OUT_OF_HEAP` when it leaves the heap;
+// `update` and `erase` also need `Positions::get(element)`.
+// `Arity` children of a node are stored together,
+// so for small `T` a wider heap touches fewer cache lines on the way down.
 template <
     typename T,
     class Compare = greater<T>,
-    void(*Swap)(T& first, T& second) = swap
+    class Positions = IgnorePositions<T>,
+    int Arity = 2
 >
 class Heap {
-    friend void CheckHeap(const vector<int>& input, const Heap<int>& heap, string methodName);
+    template <int CheckedArity>
+    friend void CheckHeap(const vector<int>& input,
+                          const Heap<int, greater<int>, IgnorePositions<int>, CheckedArity>& heap,
+                          string methodName);
 
 public:
-    Heap() {}
+    explicit Heap(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : elements_(resource),
+          ordered_(true)
+    {}
 
     explicit Heap(const vector<T>& elements) 
-        : elements_(elements) 
+        : elements_(elements.begin(), elements.end()),
+          ordered_(true)
     {
-        for (int i = elements_.size() / 2; i >= 0; --i) {
-            int position = i;
-            siftDown(position);
+        for (int i = 0; i < int(size()); ++i) {
+            positions_.set(elements_[i], i);
         }
+        heapify();
     }
 
     bool empty() const {
@@ -124,21 +564,56 @@ public:
 
     void remove(int position) {
         if (!empty()) {
-            if (position >= size() || position < 0) {
+            if (position < 0 || size_t(position) >= size()) {
                 return;
             }
 
-            if (position == size() - 1) {
+            positions_.set(element(position), OUT_OF_HEAP);
+            if (size_t(position) == size() - 1) {
                 elements_.pop_back();
                 return;
             }
 
-            Swap(elements_.at(position), elements_.at(size() - 1));
+            T last = elements_.back();
             elements_.pop_back();
+            place(last, position);
+            updateHeap(position);
+        }
+    }
 
-            if (!empty()) {
-                updateHeap(position);
-            }
+    // Removes the element in O(log n).
+    void erase(const T& elem) {
+        remove(positions_.get(elem));
+    }
+
+    // Restores the order after the key of the element was changed in place.
+    void update(const T& elem) {
+        updateHeap(positions_.get(elem));
+    }
+
+    // The elements in the heap order.
+    const std::pmr::vector<T>& elements() const {
+        return elements_;
+    }
+
+    // Replaces the elements by ones already in the heap order.
+    void assignOrdered(const vector<T>& elements) {
+        elements_.assign(elements.begin(), elements.end());
+        for (int i = 0; i < int(size()); ++i) {
+            positions_.set(elements_[i], i);
+        }
+    }
+
+    // Until `restoreOrder` the changes take O(1) and `top` is undefined.
+    void suspendOrder() {
+        ordered_ = false;
+    }
+
+    // Restores the order in O(n) by the bottom-up heapify.
+    void restoreOrder() {
+        if (!ordered_) {
+            ordered_ = true;
+            heapify();
         }
     }
 
@@ -164,484 +639,5289 @@ public:
 
     void insert(const T& elem) {
         elements_.push_back(elem);
+        positions_.set(elem, size() - 1);
         updateHeap(size() - 1);
     }
 
 private:
+    // Bounds are checked only in debug builds, the sifts are on every request.
+    T& element(int position) {
+#ifdef NDEBUG
+        return elements_[position];
+#else
+        return elements_.at(position);
+#endif
+    }
+
+    void place(const T& elem, int position) {
+        element(position) = elem;
+        positions_.set(elem, position);
+    }
+
+    void heapify() {
+        if (size() < 2) {
+            return;
+        }
+        for (int i = (int(size()) - 2) / Arity; i >= 0; --i) {
+            T elem = element(i);
+            place(elem, siftDown(elem, i));
+        }
+    }
+
     // Restores heap features.
     void updateHeap(int position) {
-        siftUp(position);
-        siftDown(position);
+        if (!ordered_) {
+            return;
+        }
+        T elem = element(position);
+        place(elem, siftDown(elem, siftUp(elem, position)));
     }
 
-    void siftUp(int& position) {
-        int parent = (position - 1) / 2;
-
-        while (compare_(elements_.at(position), elements_.at(parent))) {
-            Swap(elements_.at(position), elements_.at(parent));
+    // The sifts move the hole of `elem` and return its final position.
+    int siftUp(const T& elem, int position) {
+        while (position > 0) {
+            int parent = (position - 1) / Arity;
+            if (!compare_(elem, element(parent))) {
+                break;
+            }
+            place(element(parent), position);
             position = parent;
-            parent = (position - 1) / 2;
         }
+        return position;
     }
 
-    void siftDown(int& position) {
-        for (int iter = elements_.size() / 2; iter >= 1; --iter) {
-            int leftChild = position * 2 + 1;
-            int rightChild = position * 2 + 2;
-            int largestChild = position;
-
-            if (leftChild < size() &&
-                compare_(elements_.at(leftChild), elements_.at(largestChild))) {
-                largestChild = leftChild;
+    int siftDown(const T& elem, int position) {
+        int heapSize = size();
+        while (true) {
+            int firstChild = position * Arity + 1;
+            if (firstChild >= heapSize) {
+                break;
             }
-            if (rightChild < size() &&
-                compare_(elements_.at(rightChild), elements_.at(largestChild))) {
-                largestChild = rightChild;
+
+            int lastChild = std::min(firstChild + Arity, heapSize);
+            int largestChild = firstChild;
+            for (int child = firstChild + 1; child < lastChild; ++child) {
+                if (compare_(element(child), element(largestChild))) {
+                    largestChild = child;
+                }
             }
-            if (largestChild == position) {
+            if (!compare_(element(largestChild), elem)) {
                 break;
             }
 
-            Swap(elements_.at(position), elements_.at(largestChild));
+            place(element(largestChild), position);
             position = largestChild;
         }
+        return position;
     }
 
     Compare compare_;
-    vector<T> elements_;
+    Positions positions_;
+    std::pmr::vector<T> elements_;
+    bool ordered_;
 };
 
-class Operation {
-public:
-    unsigned int id;
-    MemoryPartIterator part;
-    
-    Operation(unsigned int id, const MemoryPartIterator& part)
-        : id(id),
-          part(part)
-    {}
+struct FreeBlockKey {
+    MemorySize size;
+    MemorySize offset;
 };
 
-typedef vector<Operation>::iterator OperationIterator;
-
-class MemoryManager {
+class OrderBySize {
 public:
-    explicit MemoryManager(int memorySize) 
-        : requestsCount(0) 
-    {
-        MemoryPart allMemory(memorySize, 1, 0, IS_FREE);
-        memoryParts_.push_back(allMemory);
-        freeMemory_.insert(memoryParts_.begin());
-    }
-
-    // Revokes the request for memory allocating.
-    // Takes the number of request for revoking.
-    void revoke(size_t requestNumber) {
-        ++requestsCount;
-        OperationIterator operationForRevoke = findOperationById(requestNumber);
-
-        if (operationForRevoke == operationsHistory_.end()) {
-            return;
+    bool operator() (const FreeBlockKey& left, const FreeBlockKey& right) const {
+        if (left.size == right.size) {
+            return left.offset < right.offset;
         }
+        return left.size < right.size;
+    }
+};
 
-        MemoryPartIterator part = operationForRevoke->part;
-        part->state = IS_FREE;
-        merge(part, next(part));
+class OrderByOffset {
+public:
+    bool operator() (const FreeBlockKey& left, const FreeBlockKey& right) const {
+        return left.offset < right.offset;
+    }
+};
 
-        MemoryPartIterator prev = part;
-        if (prev->offset != 1) {
-            --prev;
-        }
+// Treap of free memory parts ordered by `Order`.
+// Every node also keeps the maximal size of the parts in its subtree,
+// which gives the leftmost part of at least the given size in O(log n)
+// for any order. The tree position of a part is stored in its `index`.
+template <class Order>
+class FreeBlockTree {
+public:
+    explicit FreeBlockTree(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : nodes_(resource),
+          root_(NO_NODE),
+          freeNodes_(NO_NODE),
+          size_(0),
+          seed_(2463534242u)
+    {}
 
-        bool result = merge(prev, part);
-        if (result) {
-            prev->index = freeMemory_.size();
-            freeMemory_.insert(prev);
-        } else {
-            part->index = freeMemory_.size();
-            freeMemory_.insert(part);
-        }
+    bool empty() const {
+        return root_ == NO_NODE;
+    }
 
-        operationsHistory_.erase(operationForRevoke);
+    size_t size() const {
+        return size_;
     }
 
-    // Tries to allocate memory of the given size.
-    // Returns the offset of the allocated memory part in success,
-    // else returns -1.
-    int allocate(int requestedMemorySize) {
-        ++requestsCount;
-        if (freeMemory_.empty()) {
-            return FAIL_CODE;
-        }
+    void insert(MemoryPartIterator part) {
+        int node = allocateNode(part);
+        part->index = node;
 
-        MemoryPartIterator maxSizeMemoryPart = freeMemory_.top();
+        int left, right;
+        split(root_, nodes_[node].key, false, left, right);
+        root_ = merge(merge(left, node), right);
+        ++size_;
+    }
 
-        if (maxSizeMemoryPart->size < requestedMemorySize) {
-            return FAIL_CODE;
+    // Removes the part if it is in the tree.
+    void remove(MemoryPartIterator part) {
+        if (part->index == OUT_OF_HEAP) {
+            return;
         }
-        freeMemory_.pop();
 
-        int firstFreeCell = maxSizeMemoryPart->offset;
+        int node = part->index;
+        FreeBlockKey key = nodes_[node].key;
+        int left, middle, right;
+        split(root_, key, false, left, right);
+        split(right, key, true, middle, right);
+        root_ = merge(left, right);
 
-        if (maxSizeMemoryPart->size > requestedMemorySize) {
-            MemoryPart newMemoryPart(requestedMemorySize,
-                                     maxSizeMemoryPart->offset,
-                                     OUT_OF_HEAP,
-                                     IS_OCCUPIED);
-            maxSizeMemoryPart->offset += requestedMemorySize;
-            maxSizeMemoryPart->size -= requestedMemorySize;
-            maxSizeMemoryPart->index = freeMemory_.size();
+        nodes_[node].left = freeNodes_;
+        freeNodes_ = node;
+        part->index = OUT_OF_HEAP;
+        --size_;
+    }
 
-            memoryParts_.insert(maxSizeMemoryPart, newMemoryPart);
-            freeMemory_.insert(maxSizeMemoryPart);
-            --maxSizeMemoryPart;
-        } else {
-            maxSizeMemoryPart->state = IS_OCCUPIED;
-        }
+    // Returns the leftmost part of at least `size` cells,
+    // or the end iterator if there is no such part.
+    MemoryPartIterator findLeftmost(MemorySize size) const {
+        return partAt(findLeftmost(root_, size));
+    }
 
-        Operation operation(requestsCount, maxSizeMemoryPart);
-        operationsHistory_.push_back(operation);
-        return firstFreeCell;
-    }   
+    // Returns the leftmost part of at least `size` cells
+    // among the parts not less than `from`.
+    MemoryPartIterator findLeftmostFrom(const FreeBlockKey& from, MemorySize size) const {
+        return partAt(findLeftmostFrom(root_, from, size));
+    }
 
-private:
-    // Tries to merge two memory parts.
-    // Returns `true` if the parts were merged, else returns `false`.
-    bool merge(MemoryPartIterator first, MemoryPartIterator second) {
-        if (second == memoryParts_.end() || second == memoryParts_.begin()) {
-            return false;
+    // Returns the first part not less than `key`.
+    MemoryPartIterator lowerBound(const FreeBlockKey& key) const {
+        int node = root_;
+        int found = NO_NODE;
+        while (node != NO_NODE) {
+            if (order_(nodes_[node].key, key)) {
+                node = nodes_[node].right;
+            } else {
+                found = node;
+                node = nodes_[node].left;
+            }
         }
+        return partAt(found);
+    }
 
-        if (first->state == IS_FREE && second->state == IS_FREE) {
-            freeMemory_.remove(first->index);
-            freeMemory_.remove(second->index);
-            first->index = OUT_OF_HEAP;
-            second->index = OUT_OF_HEAP;
-            first->size += second->size;
-            memoryParts_.erase(second);
-            return true;
+    // Returns the last part less than `key`.
+    MemoryPartIterator lastBefore(const FreeBlockKey& key) const {
+        int node = root_;
+        int found = NO_NODE;
+        while (node != NO_NODE) {
+            if (order_(nodes_[node].key, key)) {
+                found = node;
+                node = nodes_[node].right;
+            } else {
+                node = nodes_[node].left;
+            }
         }
+        return partAt(found);
+    }
 
-        return false;
+    // Calls `visit` for the parts in [from, to) in order.
+    template <class Visitor>
+    void visitRange(const FreeBlockKey& from, const FreeBlockKey& to, Visitor visit) const {
+        visitRange(root_, from, to, visit);
     }
 
-    OperationIterator findOperationById(unsigned int id) {
-        int left = 0;
-        int right = operationsHistory_.size() - 1;
+    // Calls `visit` for every part in the order.
+    template <class Visitor>
+    void visitAll(Visitor visit) const {
+        visitAll(root_, visit);
+    }
 
-        while (left <= right) {
-            int mid = left + (right - left) / 2;
+    // Writes the handles of the parts in the order.
+    void save(SnapshotWriter& writer) const {
+        vector<MemoryPartHandle> parts;
+        parts.reserve(size_);
+        visitAll([&parts](MemoryPartIterator part) {
+            parts.push_back(part.handle());
+        });
+        writer.writeVector(parts);
+    }
 
-            if (operationsHistory_.at(mid).id == id) {
-                return operationsHistory_.begin() + mid;
-            }
-            if (operationsHistory_.at(mid).id > id) {
-                right = mid - 1;
-            } else {
-                left = mid + 1;
-            }
+    // Inserts the parts saved by `save`, the tree is built anew.
+    void load(SnapshotReader& reader, MemoryPartList& memoryParts) {
+        *this = FreeBlockTree(nodes_.get_allocator().resource());
+        vector<MemoryPartHandle> parts;
+        reader.readVector(parts);
+        for (size_t i = 0; i < parts.size(); ++i) {
+            reader.check(memoryParts.isHandle(parts[i]));
+            insert(memoryParts.at(parts[i]));
         }
-         
-        return operationsHistory_.end();
     }
 
-    vector<Operation> operationsHistory_;
-    list<MemoryPart> memoryParts_;
-    Heap<MemoryPartIterator,
-        CompareMemoryPartsBySize,
-        SwapMemoryPartIterators> freeMemory_;
-    unsigned int requestsCount;
-};
+    // Returns `true` if the part is in the tree.
+    bool contains(MemoryPartIterator part) const {
+        return part->index >= 0 && size_t(part->index) < nodes_.size() &&
+               nodes_[part->index].part == part;
+    }
+
+private:
+    static const int NO_NODE = -1;
 
-class Request {
-    friend Request* readInput(istream& stream);
+    struct Node {
+        FreeBlockKey key;
+        MemorySize maxSize;
+        unsigned int priority;
+        int left;
+        int right;
+        MemoryPartIterator part;
+    };
 
-public:         
-    Request() {}
+    int allocateNode(MemoryPartIterator part) {
+        int node = freeNodes_;
+        if (node == NO_NODE) {
+            nodes_.push_back(Node());
+            node = nodes_.size() - 1;
+        } else {
+            freeNodes_ = nodes_[node].left;
+        }
 
-    virtual ~Request() {}
+        // xorshift gives random but reproducible priorities.
+        seed_ ^= seed_ << 13;
+        seed_ ^= seed_ >> 17;
+        seed_ ^= seed_ << 5;
 
-    RequestType type() const {
-        return type_;
+        Node& newNode = nodes_[node];
+        newNode.key.size = part->size;
+        newNode.key.offset = part->offset;
+        newNode.maxSize = part->size;
+        newNode.priority = seed_;
+        newNode.left = NO_NODE;
+        newNode.right = NO_NODE;
+        newNode.part = part;
+        return node;
     }
 
-    virtual int size() const {
-        throw MethodNotOverridenException();
+    MemoryPartIterator partAt(int node) const {
+        if (node == NO_NODE) {
+            return MemoryPartIterator();
+        }
+        return nodes_[node].part;
     }
 
-    virtual int operationForRevoke() const {
-        throw MethodNotOverridenException();
+    MemorySize maxSize(int node) const {
+        return node == NO_NODE ? -1 : nodes_[node].maxSize;
+    }
+
+    void update(int node) {
+        nodes_[node].maxSize = std::max(nodes_[node].key.size,
+            std::max(maxSize(nodes_[node].left), maxSize(nodes_[node].right)));
+    }
+
+    // Splits the subtree into the parts less than `key` (or not greater
+    // than `key` if `inclusive`) and the rest.
+    void split(int node, const FreeBlockKey& key, bool inclusive, int& left, int& right) {
+        if (node == NO_NODE) {
+            left = right = NO_NODE;
+            return;
+        }
+
+        bool goesLeft = inclusive ? !order_(key, nodes_[node].key)
+                                  : order_(nodes_[node].key, key);
+        if (goesLeft) {
+            split(nodes_[node].right, key, inclusive, nodes_[node].right, right);
+            left = node;
+        } else {
+            split(nodes_[node].left, key, inclusive, left, nodes_[node].left);
+            right = node;
+        }
+        update(node);
+    }
+
+    // Merges two subtrees, all the parts of `left` must be less than
+    // the parts of `right`.
+    int merge(int left, int right) {
+        if (left == NO_NODE) {
+            return right;
+        }
+        if (right == NO_NODE) {
+            return left;
+        }
+
+        if (nodes_[left].priority > nodes_[right].priority) {
+            nodes_[left].right = merge(nodes_[left].right, right);
+            update(left);
+            return left;
+        } else {
+            nodes_[right].left = merge(left, nodes_[right].left);
+            update(right);
+            return right;
+        }
+    }
+
+    int findLeftmost(int node, MemorySize size) const {
+        while (node != NO_NODE && nodes_[node].maxSize >= size) {
+            if (maxSize(nodes_[node].left) >= size) {
+                node = nodes_[node].left;
+            } else if (nodes_[node].key.size >= size) {
+                return node;
+            } else {
+                node = nodes_[node].right;
+            }
+        }
+        return NO_NODE;
+    }
+
+    int findLeftmostFrom(int node, const FreeBlockKey& from, MemorySize size) const {
+        if (node == NO_NODE || nodes_[node].maxSize < size) {
+            return NO_NODE;
+        }
+        if (order_(nodes_[node].key, from)) {
+            return findLeftmostFrom(nodes_[node].right, from, size);
+        }
+
+        int found = findLeftmostFrom(nodes_[node].left, from, size);
+        if (found != NO_NODE) {
+            return found;
+        }
+        if (nodes_[node].key.size >= size) {
+            return node;
+        }
+        return findLeftmost(nodes_[node].right, size);
+    }
+
+    template <class Visitor>
+    void visitAll(int node, Visitor& visit) const {
+        if (node != NO_NODE) {
+            visitAll(nodes_[node].left, visit);
+            visit(nodes_[node].part);
+            visitAll(nodes_[node].right, visit);
+        }
+    }
+
+    template <class Visitor>
+    void visitRange(int node, const FreeBlockKey& from, const FreeBlockKey& to,
+                    Visitor& visit) const {
+        if (node == NO_NODE) {
+            return;
+        }
+
+        bool afterFrom = !order_(nodes_[node].key, from);
+        bool beforeTo = order_(nodes_[node].key, to);
+        if (afterFrom) {
+            visitRange(nodes_[node].left, from, to, visit);
+        }
+        if (afterFrom && beforeTo) {
+            visit(nodes_[node].part);
+        }
+        if (beforeTo) {
+            visitRange(nodes_[node].right, from, to, visit);
+        }
+    }
+
+    Order order_;
+    std::pmr::vector<Node> nodes_;
+    int root_;
+    // Head of the list of the removed nodes, linked by `left`.
+    int freeNodes_;
+    size_t size_;
+    unsigned int seed_;
+};
+
+// Placement policies choose the free memory part for an allocation.
+// Each policy indexes the free parts by its own structure and provides
+// `empty`, `size`, `insert`, `remove` (a no-op for parts out of the index),
+// `resize`, which moves the bounds of an indexed part, `find`, which
+// returns a free part of at least the given size or the end iterator, and
+// `suspendOrder` and `restoreOrder`, between which `find` is not called,
+// so the index may postpone its ordering to one rebuild, and `save` and
+// `load` for the snapshots, with `SNAPSHOT_TAG` telling the placements apart.
+// A policy is constructed with the memory resource of its index.
+
+// The four children of a node in the heap of free parts take one cache line.
+const int FREE_PARTS_HEAP_ARITY = 4;
+
+// Takes the largest free part, the leftmost one among equal parts.
+class WorstFitPlacement {
+public:
+    static constexpr uint32_t SNAPSHOT_TAG = 1;
+
+    explicit WorstFitPlacement(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : heap_(resource)
+    {}
+
+    bool empty() const {
+        return heap_.empty();
+    }
+
+    size_t size() const {
+        return heap_.size();
+    }
+
+    void insert(MemoryPartIterator part) {
+        heap_.insert(part);
+    }
+
+    void remove(MemoryPartIterator part) {
+        if (part->index != OUT_OF_HEAP) {
+            heap_.erase(part);
+        }
+    }
+
+    void resize(MemoryPartIterator part, MemorySize offset, MemorySize size) {
+        part->offset = offset;
+        part->size = size;
+        heap_.update(part);
+    }
+
+    MemoryPartIterator find(MemorySize size) {
+        if (heap_.empty() || heap_.top()->size < size) {
+            return MemoryPartIterator();
+        }
+        return heap_.top();
+    }
+
+    void suspendOrder() {
+        heap_.suspendOrder();
+    }
+
+    void restoreOrder() {
+        heap_.restoreOrder();
+    }
+
+    // The heap order is saved as is, so loading takes no comparisons.
+    void save(SnapshotWriter& writer) const {
+        const std::pmr::vector<MemoryPartIterator>& parts = heap_.elements();
+        vector<MemoryPartHandle> handles(parts.size());
+        for (size_t i = 0; i < parts.size(); ++i) {
+            handles[i] = parts[i].handle();
+        }
+        writer.writeVector(handles);
+    }
+
+    // Throws `InvalidSnapshotException` unless the parts are in the heap order.
+    void load(SnapshotReader& reader, MemoryPartList& memoryParts) {
+        vector<MemoryPartHandle> handles;
+        reader.readVector(handles);
+        vector<MemoryPartIterator> parts(handles.size());
+        CompareMemoryPartsBySize compare;
+        for (size_t i = 0; i < handles.size(); ++i) {
+            reader.check(memoryParts.isHandle(handles[i]));
+            parts[i] = memoryParts.at(handles[i]);
+            reader.check(i == 0 || !compare(parts[i], parts[(i - 1) / FREE_PARTS_HEAP_ARITY]));
+        }
+        heap_.assignOrdered(parts);
+    }
+
+    bool contains(MemoryPartIterator part) const {
+        const std::pmr::vector<MemoryPartIterator>& parts = heap_.elements();
+        return part->index >= 0 && size_t(part->index) < parts.size() && parts[part->index] == part;
+    }
+
+private:
+    Heap<MemoryPartIterator,
+        CompareMemoryPartsBySize,
+        MemoryPartPositions,
+        FREE_PARTS_HEAP_ARITY> heap_;
+};
+
+// Takes the smallest suitable free part, the leftmost one among equal parts.
+class BestFitPlacement {
+public:
+    static constexpr uint32_t SNAPSHOT_TAG = 2;
+
+    explicit BestFitPlacement(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : tree_(resource)
+    {}
+
+    bool empty() const {
+        return tree_.empty();
+    }
+
+    size_t size() const {
+        return tree_.size();
+    }
+
+    void insert(MemoryPartIterator part) {
+        tree_.insert(part);
+    }
+
+    // The tree is kept ordered.
+    void suspendOrder() {}
+    void restoreOrder() {}
+
+    void save(SnapshotWriter& writer) const {
+        tree_.save(writer);
+    }
+
+    void load(SnapshotReader& reader, MemoryPartList& memoryParts) {
+        tree_.load(reader, memoryParts);
+    }
+
+    bool contains(MemoryPartIterator part) const {
+        return tree_.contains(part);
+    }
+
+    void remove(MemoryPartIterator part) {
+        tree_.remove(part);
+    }
+
+    void resize(MemoryPartIterator part, MemorySize offset, MemorySize size) {
+        tree_.remove(part);
+        part->offset = offset;
+        part->size = size;
+        tree_.insert(part);
+    }
+
+    MemoryPartIterator find(MemorySize size) {
+        return tree_.findLeftmost(size);
+    }
+
+private:
+    FreeBlockTree<OrderBySize> tree_;
+};
+
+// Base of the placements indexing the free parts by offset. Besides the
+// placement interface it finds the free neighbours of a cell and the free
+// parts in a range of cells in O(log n + k).
+class OffsetOrderedPlacement {
+public:
+    explicit OffsetOrderedPlacement(
+        std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : tree_(resource)
+    {}
+
+    bool empty() const {
+        return tree_.empty();
+    }
+
+    size_t size() const {
+        return tree_.size();
+    }
+
+    void insert(MemoryPartIterator part) {
+        tree_.insert(part);
+    }
+
+    // The tree is kept ordered.
+    void suspendOrder() {}
+    void restoreOrder() {}
+
+    void save(SnapshotWriter& writer) const {
+        tree_.save(writer);
+    }
+
+    void load(SnapshotReader& reader, MemoryPartList& memoryParts) {
+        tree_.load(reader, memoryParts);
+    }
+
+    bool contains(MemoryPartIterator part) const {
+        return tree_.contains(part);
+    }
+
+    void remove(MemoryPartIterator part) {
+        tree_.remove(part);
+    }
+
+    // The tree keeps the maximum sizes of the subtrees, so the part is reinserted.
+    void resize(MemoryPartIterator part, MemorySize offset, MemorySize size) {
+        tree_.remove(part);
+        part->offset = offset;
+        part->size = size;
+        tree_.insert(part);
+    }
+
+    // Returns the nearest free part starting to the left of `offset`,
+    // or the end iterator if there is none.
+    MemoryPartIterator freePartBefore(MemorySize offset) const {
+        FreeBlockKey key = {0, offset};
+        return tree_.lastBefore(key);
+    }
+
+    // Returns the nearest free part starting at `offset` or to the right of it,
+    // or the end iterator if there is none.
+    MemoryPartIterator freePartFrom(MemorySize offset) const {
+        FreeBlockKey key = {0, offset};
+        return tree_.lowerBound(key);
+    }
+
+    // Appends to `parts` the free parts intersecting the cells [first, last).
+    void freePartsInRange(MemorySize first, MemorySize last,
+                          vector<MemoryPartIterator>& parts) const {
+        MemoryPartIterator before = freePartBefore(first);
+        if (before != MemoryPartIterator() && before->offset + before->size > first) {
+            parts.push_back(before);
+        }
+
+        FreeBlockKey from = {0, first};
+        FreeBlockKey to = {0, last};
+        tree_.visitRange(from, to, [&parts](MemoryPartIterator part) {
+            parts.push_back(part);
+        });
     }
 
 protected:
-    RequestType type_;
+    FreeBlockTree<OrderByOffset> tree_;
+};
+
+// Takes the leftmost suitable free part.
+class FirstFitPlacement : public OffsetOrderedPlacement {
+public:
+    static constexpr uint32_t SNAPSHOT_TAG = 3;
+
+    using OffsetOrderedPlacement::OffsetOrderedPlacement;
+
+    MemoryPartIterator find(MemorySize size) {
+        return tree_.findLeftmost(size);
+    }
+};
+
+// Takes the leftmost suitable free part starting not before the end of
+// the previous allocation, wraps around to the beginning if there is none.
+class NextFitPlacement : public OffsetOrderedPlacement {
+public:
+    static constexpr uint32_t SNAPSHOT_TAG = 4;
+
+    explicit NextFitPlacement(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : OffsetOrderedPlacement(resource),
+          rover_(0)
+    {}
+
+    void save(SnapshotWriter& writer) const {
+        OffsetOrderedPlacement::save(writer);
+        writer.writeValue(rover_);
+    }
+
+    void load(SnapshotReader& reader, MemoryPartList& memoryParts) {
+        OffsetOrderedPlacement::load(reader, memoryParts);
+        rover_ = reader.readValue<MemorySize>();
+    }
+
+    MemoryPartIterator find(MemorySize size) {
+        FreeBlockKey from = {0, rover_};
+        MemoryPartIterator part = tree_.findLeftmostFrom(from, size);
+        if (part == MemoryPartIterator()) {
+            part = tree_.findLeftmost(size);
+        }
+        if (part != MemoryPartIterator()) {
+            rover_ = part->offset + size;
+        }
+        return part;
+    }
+
+private:
+    MemorySize rover_;
+};
+
+class Operation {
+public:
+    unsigned int id;
+    MemoryPartHandle part;
+
+    Operation()
+        : id(NO_OPERATION),
+          part(NO_MEMORY_PART)
+    {}
+
+    Operation(unsigned int id, MemoryPartHandle part)
+        : id(id),
+          part(part)
+    {}
+};
+
+// Maps the ids of the live allocation requests to their operations.
+// `T` must have the `id` field and be `NO_OPERATION` by default.
+// Uses open addressing with linear probing. Erased slots are freed by
+// shifting the following entries back, so there are no tombstones, the
+// slots are reused and the table size depends only on the number of
+// live allocations. The slots are allocated by the first insertion, so
+// an idle manager costs no table.
+template <class T>
+class OperationsTable {
+public:
+    explicit OperationsTable(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : slots_(resource),
+          size_(0),
+          hashShift_(0)
+    {}
+
+    // Returns the operation with the given id or `nullptr` if there is none.
+    T* find(unsigned int id) {
+        if (id == NO_OPERATION || slots_.empty()) {
+            return nullptr;
+        }
+
+        for (size_t slot = slotFor(id); ; slot = nextSlot(slot)) {
+            if (slots_[slot].id == id) {
+                return &slots_[slot];
+            }
+            if (slots_[slot].id == NO_OPERATION) {
+                return nullptr;
+            }
+        }
+    }
+
+    // Adds the operation, its id must not be in the table yet.
+    void insert(const T& operation) {
+        if (2 * (size_ + 1) > slots_.size()) {
+            rehash(std::max(MIN_CAPACITY, 2 * slots_.size()));
+        }
+
+        size_t slot = slotFor(operation.id);
+        while (slots_[slot].id != NO_OPERATION) {
+            slot = nextSlot(slot);
+        }
+        slots_[slot] = operation;
+        ++size_;
+    }
+
+    // Removes the operation returned by `find`.
+    void erase(T* operation) {
+        size_t hole = operation - slots_.data();
+        slots_[hole].id = NO_OPERATION;
+        --size_;
+
+        for (size_t slot = nextSlot(hole); slots_[slot].id != NO_OPERATION;
+             slot = nextSlot(slot)) {
+            size_t home = slotFor(slots_[slot].id);
+            // The entry may be moved into the hole only if its home slot
+            // is not inside the cyclic interval (hole, slot].
+            bool homeBetween = hole < slot ? (hole < home && home <= slot)
+                                           : (hole < home || home <= slot);
+            if (!homeBetween) {
+                slots_[hole] = slots_[slot];
+                slots_[slot].id = NO_OPERATION;
+                hole = slot;
+            }
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // The slots are saved as is, so loading takes no hashing.
+    void save(SnapshotWriter& writer) const {
+        writer.writeValue(uint64_t(size_));
+        writer.writeVector(slots_);
+    }
+
+    // Throws `InvalidSnapshotException` unless the slots are a table of
+    // `size` operations, which keeps an empty slot for `find` to stop at.
+    void load(SnapshotReader& reader) {
+        size_ = reader.readValue<uint64_t>();
+        reader.readVector(slots_);
+        if (slots_.empty()) {
+            reader.check(size_ == 0);
+            return;
+        }
+        reader.check(slots_.size() >= MIN_CAPACITY && (slots_.size() & (slots_.size() - 1)) == 0);
+        size_t operationsCount = 0;
+        forEach([&operationsCount](const T& /* operation */) {
+            ++operationsCount;
+        });
+        reader.check(operationsCount == size_ && 2 * size_ <= slots_.size());
+        updateHashShift();
+    }
+
+    // Calls `visit` for every operation in the order of the slots.
+    template <class Visitor>
+    void forEach(Visitor visit) const {
+        for (size_t slot = 0; slot < slots_.size(); ++slot) {
+            if (slots_[slot].id != NO_OPERATION) {
+                visit(slots_[slot]);
+            }
+        }
+    }
+
+private:
+    static constexpr size_t MIN_CAPACITY = 16;
+
+    // Fibonacci hashing: the high bits of the product select the slot, so
+    // the consecutive ids are spread over the whole table.
+    size_t slotFor(unsigned int id) const {
+        return static_cast<uint32_t>(id * 2654435769u) >> hashShift_;
+    }
+
+    // The shift of `slotFor` for the current number of slots.
+    void updateHashShift() {
+        hashShift_ = 32 - __builtin_ctzll(slots_.size());
+    }
+
+    size_t nextSlot(size_t slot) const {
+        return (slot + 1) & (slots_.size() - 1);
+    }
+
+    void rehash(size_t capacity) {
+        std::pmr::vector<T> oldSlots(capacity, slots_.get_allocator());
+        oldSlots.swap(slots_);
+        updateHashShift();
+        size_ = 0;
+        for (size_t i = 0; i < oldSlots.size(); ++i) {
+            if (oldSlots[i].id != NO_OPERATION) {
+                insert(oldSlots[i]);
+            }
+        }
+    }
+
+    std::pmr::vector<T> slots_;
+    size_t size_;
+    int hashShift_;
+};
+
+// Counts values in the power of two buckets: the bucket `i` is [2^i, 2^(i+1)),
+// zero goes to the first one.
+class Log2Histogram {
+public:
+    static const int BUCKETS_COUNT = 64;
+
+    Log2Histogram()
+        : counts_(BUCKETS_COUNT, 0)
+    {}
+
+    void add(uint64_t value) {
+        ++counts_[value == 0 ? 0 : 63 - __builtin_clzll(value)];
+    }
+
+    uint64_t count(int bucket) const {
+        return counts_[bucket];
+    }
+
+    // Prints the non-empty buckets as "[from, to): count" lines.
+    void print(ostream& stream, const string& indent) const {
+        for (int bucket = 0; bucket < BUCKETS_COUNT; ++bucket) {
+            if (counts_[bucket] > 0) {
+                stream << indent << '[' << (uint64_t(1) << bucket) << ", "
+                       << (bucket + 1 < BUCKETS_COUNT ? std::to_string(uint64_t(1) << (bucket + 1))
+                                                      : string("inf"))
+                       << "): " << counts_[bucket] << endl;
+            }
+        }
+    }
+
+private:
+    vector<uint64_t> counts_;
+};
+
+#ifdef MEMORY_MANAGER_STATS
+// Adds the time from the construction to the destruction in nanoseconds.
+class LatencyTimer {
+public:
+    explicit LatencyTimer(Log2Histogram& histogram)
+        : histogram_(histogram),
+          start_(std::chrono::steady_clock::now())
+    {}
+
+    ~LatencyTimer() {
+        std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start_;
+        histogram_.add(elapsed.count());
+    }
+
+private:
+    Log2Histogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+#endif
+
+// State of `MemoryManager` returned by `stats`. The parts are counted on
+// demand, so only the fields of the MEMORY_MANAGER_STATS builds cost
+// anything per request; without the macro they are zero.
+struct MemoryManagerStats {
+    int64_t freeCells;
+    // Occupied by the live allocations.
+    int64_t usedCells;
+    // Revoked, but kept cached or pending, or in the compaction gap.
+    int64_t deferredCells;
+    size_t freePartsCount;
+    int64_t largestFreePart;
+    // 1 - largestFreePart / freeCells, zero when all the free cells are
+    // in one part, close to one when they are scattered in small parts.
+    double fragmentation;
+    Log2Histogram freePartSizes;
+
+    uint64_t failedAllocations;
+    // In nanoseconds.
+    Log2Histogram allocationLatency;
+    Log2Histogram revocationLatency;
+
+    MemoryManagerStats()
+        : freeCells(0),
+          usedCells(0),
+          deferredCells(0),
+          freePartsCount(0),
+          largestFreePart(0),
+          fragmentation(0),
+          failedAllocations(0)
+    {}
+};
+
+void PrintStats(ostream& stream, const MemoryManagerStats& stats) {
+    stream << "free cells: " << stats.freeCells << endl
+           << "used cells: " << stats.usedCells << endl
+           << "cached, pending or compacting cells: " << stats.deferredCells << endl
+           << "free parts: " << stats.freePartsCount << endl
+           << "largest free part: " << stats.largestFreePart << endl
+           << "fragmentation: " << stats.fragmentation << endl
+           << "free part sizes:" << endl;
+    stats.freePartSizes.print(stream, "  ");
+#ifdef MEMORY_MANAGER_STATS
+    stream << "failed allocations: " << stats.failedAllocations << endl
+           << "allocation latency, ns:" << endl;
+    stats.allocationLatency.print(stream, "  ");
+    stream << "revocation latency, ns:" << endl;
+    stats.revocationLatency.print(stream, "  ");
+#endif
+}
+
+// Measured with --benchmark-bulk-release.
+const int DEFAULT_BULK_RELEASE_RATIO = 8;
+const int DEFAULT_COMPACTION_STEPS = 16;
+
+// The move of an allocation by the compaction.
+struct Relocation {
+    MemorySize oldOffset;
+    MemorySize newOffset;
+
+    bool operator == (const Relocation& other) const {
+        return oldOffset == other.oldOffset && newOffset == other.newOffset;
+    }
 };
 
-class AllocationRequest : public Request {
-    friend Request* readInput(istream& stream);
+ostream& operator << (ostream& stream, const Relocation& relocation) {
+    return stream << relocation.oldOffset << "->" << relocation.newOffset;
+}
+
+// Optional features of `MemoryManager`.
+struct MemoryManagerOptions {
+    // Sizes of the segregated size classes. An allocation not greater than
+    // the largest class is rounded up to the nearest class, and on revoking
+    // its part is cached in the free list of the class instead of being
+    // merged. The next allocation of the class takes a cached part in O(1).
+    // The cached parts are merged back only when an allocation fails.
+    // Empty by default, then the results follow the placement exactly.
+    vector<int> sizeClasses;
+    // The managed cells are [firstCell, firstCell + memorySize).
+    MemorySize firstCell;
+    // If positive, a revoked part (not of a size class) stays pending
+    // instead of being merged with the free neighbours at once. The pending
+    // parts are merged in bulk when `pendingLimit` of them are collected or
+    // an allocation fails. Until then they are not used by allocations, so
+    // the offsets may differ from the eager merging. An allocation still
+    // fails only if there is no free run of its size with all the revoked
+    // memory merged, like in the eager mode. Zero by default.
+    int pendingLimit;
+    // If positive, releasing at least 1 / `bulkReleaseRatio` of the number
+    // of the free parts at once (a run of revocations in `process` or the
+    // merging of the cached or the pending parts) suspends the order of the
+    // placement index and restores it by one rebuild, which is O(n) for
+    // the worst fit heap instead of O(k log n). Zero disables it.
+    int bulkReleaseRatio;
+    // If positive, a compaction pass starts when there are
+    // `compactionThreshold` free parts, and every allocation, revocation
+    // and reallocation advances it by `compactionSteps` steps before it is
+    // served (see `MemoryManager::compact`). Zero by default.
+    int compactionThreshold;
+    int compactionSteps;
+    // Allocates the parts, the placement index and the operations table.
+    // The default resource by default.
+    std::pmr::memory_resource* resource;
+
+    MemoryManagerOptions()
+        : firstCell(1),
+          pendingLimit(0),
+          bulkReleaseRatio(DEFAULT_BULK_RELEASE_RATIO),
+          compactionThreshold(0),
+          compactionSteps(DEFAULT_COMPACTION_STEPS),
+          resource(std::pmr::get_default_resource())
+    {}
+};
+
+// Returns the size classes 1, 2, 4, ... up to `maxSize`.
+vector<int> PowerOfTwoSizeClasses(int maxSize) {
+    vector<int> sizeClasses;
+    for (int size = 1; size > 0 && size <= maxSize; size *= 2) {
+        sizeClasses.push_back(size);
+    }
+    return sizeClasses;
+}
+
+// Manages the memory cells [1, memorySize].
+// `Placement` chooses the free memory part for every allocation,
+// see `WorstFitPlacement` for the interface.
+template <class Placement = WorstFitPlacement>
+class MemoryManager {
+public:
+    // Throws `std::length_error` if the cells don't fit in `MAX_MEMORY_SIZE`
+    // and `std::invalid_argument` if a size class is not positive.
+    explicit MemoryManager(MemorySize memorySize,
+                           const MemoryManagerOptions& options = MemoryManagerOptions())
+        : operationsHistory_(options.resource),
+          memoryParts_(options.resource),
+          freeMemory_(options.resource),
+          sizeClasses_(options.sizeClasses.begin(), options.sizeClasses.end(), options.resource),
+          cachedParts_(options.resource),
+          cachedPartsCount_(0),
+          pendingLimit_(options.pendingLimit),
+          pendingParts_(options.resource),
+          bulkReleaseRatio_(options.bulkReleaseRatio),
+          compactionThreshold_(options.compactionThreshold),
+          compactionSteps_(options.compactionSteps),
+          compactionGap_(NO_MEMORY_PART),
+          requestsCount(0) 
+    {
+        pendingParts_.reserve(std::max(pendingLimit_, 0));
+        std::sort(sizeClasses_.begin(), sizeClasses_.end());
+        sizeClasses_.erase(std::unique(sizeClasses_.begin(), sizeClasses_.end()),
+                           sizeClasses_.end());
+        if (!sizeClasses_.empty() && sizeClasses_.front() <= 0) {
+            throw std::invalid_argument("the size classes must be positive");
+        }
+        cachedParts_.assign(sizeClasses_.size(), NO_MEMORY_PART);
+
+        if (memorySize < 0 || options.firstCell < 0 ||
+            memorySize > MAX_MEMORY_SIZE - options.firstCell) {
+            throw std::length_error("the memory cells exceed MAX_MEMORY_SIZE");
+        }
+        MemoryPart allMemory(memorySize, options.firstCell, OUT_OF_HEAP, IS_FREE);
+        memoryParts_.push_back(allMemory);
+        freeMemory_.insert(memoryParts_.begin());
+    }
+
+    // Revokes the request for memory allocating.
+    // Takes the number of request for revoking.
+    void revoke(size_t requestNumber) {
+#ifdef MEMORY_MANAGER_STATS
+        LatencyTimer timer(revocationLatency_);
+#endif
+        ++requestsCount;
+        advanceCompaction();
+        Operation* operationForRevoke = operationsHistory_.find(requestNumber);
+
+        if (operationForRevoke == nullptr) {
+            return;
+        }
+
+        MemoryPartHandle block = operationForRevoke->part;
+        operationsHistory_.erase(operationForRevoke);
+        freeBlock(block);
+    }
+
+    // Tries to allocate memory of the given size.
+    // Returns the offset of the allocated memory part in success,
+    // else returns -1.
+    MemorySize allocate(MemorySize requestedMemorySize) {
+#ifdef MEMORY_MANAGER_STATS
+        LatencyTimer timer(allocationLatency_);
+#endif
+        ++requestsCount;
+        advanceCompaction();
+        MemoryPartHandle block = allocateBlock(requestedMemorySize);
+        if (block == NO_MEMORY_PART) {
+            return FAIL_CODE;
+        }
+
+        Operation operation(requestsCount, block);
+        operationsHistory_.insert(operation);
+        return blockOffset(block);
+    }   
+
+    // Changes the size of the memory allocated by the request `requestNumber`,
+    // which keeps its number. The memory shrinks in place, grows in place if
+    // the following part is free and large enough, else moves.
+    // Returns the offset of the memory in success, else returns -1
+    // and the memory stays as it was.
+    MemorySize reallocate(size_t requestNumber, MemorySize newMemorySize) {
+        ++requestsCount;
+        advanceCompaction();
+        Operation* operation = operationsHistory_.find(requestNumber);
+        if (operation == nullptr) {
+            return FAIL_CODE;
+        }
+
+        MemoryPartHandle block = reallocateBlock(operation->part, newMemorySize);
+        if (block == NO_MEMORY_PART) {
+            return FAIL_CODE;
+        }
+        operation->part = block;
+        return blockOffset(block);
+    }
+
+    // Allocates memory like `allocate`, but without a request number,
+    // for the callers keeping track of their blocks themselves.
+    // Returns the block or `NO_MEMORY_PART` if there is no suitable memory.
+    MemoryPartHandle allocateBlock(MemorySize requestedMemorySize) {
+        MemoryPartIterator part = memoryParts_.end();
+        if (requestedMemorySize < 0) {
+            return NO_MEMORY_PART;
+        }
+
+        if (requestedMemorySize <= maxClassSize()) {
+            size_t sizeClass = classOf(requestedMemorySize);
+            requestedMemorySize = sizeClasses_[sizeClass];
+            part = popCachedPart(sizeClass);
+        }
+        if (part == memoryParts_.end()) {
+            part = allocatePart(requestedMemorySize);
+        }
+        if (part == memoryParts_.end() && releaseDeferredParts()) {
+            part = allocatePart(requestedMemorySize);
+        }
+        if (part == memoryParts_.end()) {
+#ifdef MEMORY_MANAGER_STATS
+            ++failedAllocations_;
+#endif
+            return NO_MEMORY_PART;
+        }
+        return part.handle();
+    }
+
+    // Reallocates the block like `reallocate`. Returns the block, which is
+    // a new one if the memory moved, or `NO_MEMORY_PART`.
+    MemoryPartHandle reallocateBlock(MemoryPartHandle block, MemorySize newMemorySize) {
+        if (newMemorySize < 0) {
+            return NO_MEMORY_PART;
+        }
+        if (newMemorySize <= maxClassSize()) {
+            newMemorySize = sizeClasses_[classOf(newMemorySize)];
+        }
+
+        MemoryPartIterator part = memoryParts_.at(block);
+        if (newMemorySize <= part->size) {
+            shrinkPart(part, newMemorySize);
+            return block;
+        }
+        if (growPart(part, newMemorySize)) {
+            return block;
+        }
+
+        MemoryPartHandle movedBlock = allocateBlock(newMemorySize);
+        if (movedBlock != NO_MEMORY_PART) {
+            freeBlock(block);
+        }
+        return movedBlock;
+    }
+
+    // Returns the first cell of the block.
+    MemorySize blockOffset(MemoryPartHandle block) {
+        return memoryParts_.at(block)->offset;
+    }
+
+    // Frees the block returned by `allocateBlock`.
+    void freeBlock(MemoryPartHandle block) {
+        MemoryPartIterator part = memoryParts_.at(block);
+        if (part->size <= maxClassSize()) {
+            pushCachedPart(part);
+        } else if (pendingLimit_ > 0) {
+            pushPendingPart(part);
+        } else {
+            release(part);
+        }
+    }
+
+    // Processes the `count` numbers of the requests in the raw encoding
+    // and writes the results of the allocations and the reallocations to
+    // `results`, which must have room for them. A reallocation cut by the
+    // end of the numbers is ignored.
+    // Returns the number of the written results. The results are the same
+    // as of processing the requests one by one; the memory parts of the
+    // upcoming revocations are prefetched meanwhile.
+    size_t process(const int* rawRequests, size_t count, MemorySize* results) {
+        const size_t prefetchDistance = 8;
+        MemorySize* result = results;
+
+        for (size_t i = 0; i < count; ++i) {
+            // The numbers of a reallocation are never negative.
+            if (i + prefetchDistance < count && IsRevocation(rawRequests[i + prefetchDistance])) {
+                Operation* operation =
+                    operationsHistory_.find(-rawRequests[i + prefetchDistance]);
+                if (operation != nullptr) {
+                    memoryParts_.prefetch(operation->part);
+                }
+            }
+
+            if (rawRequests[i] >= 0) {
+                *result++ = allocate(rawRequests[i]);
+                continue;
+            }
+            if (rawRequests[i] == REALLOCATION_CODE) {
+                if (i + REALLOCATION_LENGTH <= count) {
+                    *result++ = reallocate(rawRequests[i + 1], rawRequests[i + 2]);
+                }
+                i += REALLOCATION_LENGTH - 1;
+                continue;
+            }
+
+            // No allocation needs the placement order during a run of revocations.
+            // A reallocation ends with a non-negative number as well.
+            if ((i == 0 || rawRequests[i - 1] >= 0) && bulkReleaseRatio_ > 0) {
+                size_t runEnd = i + 1;
+                while (runEnd < count && IsRevocation(rawRequests[runEnd])) {
+                    ++runEnd;
+                }
+                suspendOrderFor(runEnd - i);
+            }
+            revoke(-rawRequests[i]);
+            if (i + 1 == count || !IsRevocation(rawRequests[i + 1])) {
+                freeMemory_.restoreOrder();
+            }
+        }
+
+        return result - results;
+    }
+
+    // Advances the compaction pass by up to `maxSteps` steps and starts a
+    // pass if there is none. The pass moves a gap from the first cell to
+    // the last one: a step makes the gap absorb the following part if it is
+    // free, else swaps them, so the allocations slide to the low offsets
+    // and the free memory gathers in one part at the end. The gap is not
+    // used by allocations until the pass ends; an allocation that fails
+    // without it ends the pass early. A step is O(1), or a removal from the
+    // placement index if the gap absorbs a free part.
+    // The moves of the allocations are recorded for `takeRelocations`.
+    // Returns `true` if the pass ended.
+    bool compact(size_t maxSteps) {
+        if (compactionGap_ == NO_MEMORY_PART) {
+            MemoryPart gap(0, memoryParts_.begin()->offset, OUT_OF_HEAP, IS_COMPACTING);
+            compactionGap_ = memoryParts_.insert(memoryParts_.begin(), gap).handle();
+        }
+
+        MemoryPartIterator gap = memoryParts_.at(compactionGap_);
+        for (size_t step = 0; step < maxSteps; ++step) {
+            MemoryPartIterator following = next(gap);
+            if (following == memoryParts_.end()) {
+                endCompaction();
+                return true;
+            }
+
+            if (following->state == IS_FREE) {
+                gap->size += following->size;
+                freeMemory_.remove(following);
+                memoryParts_.erase(following);
+                continue;
+            }
+
+            if (following->state == IS_OCCUPIED && gap->size > 0) {
+                relocations_.push_back(Relocation{following->offset, gap->offset});
+            }
+            following->offset = gap->offset;
+            MemoryPart movedGap = *gap;
+            movedGap.offset += following->size;
+            memoryParts_.erase(gap);
+            gap = memoryParts_.insert(next(following), movedGap);
+            compactionGap_ = gap.handle();
+        }
+        return false;
+    }
+
+    // Moves the relocations recorded since the last call to `relocations`,
+    // in the order of the moves.
+    void takeRelocations(vector<Relocation>& relocations) {
+        relocations.clear();
+        relocations.swap(relocations_);
+    }
+
+    // Returns the number of the last processed request,
+    // which is the id of the last allocation if it succeeded.
+    unsigned int lastRequestNumber() const {
+        return requestsCount;
+    }
+
+    // Writes the complete state, so that the manager restored by
+    // `loadSnapshot` gives the same results as this one.
+    // Returns `false` if the writing failed.
+    bool saveSnapshot(FILE* file) const {
+        SnapshotWriter writer(file);
+        writer.writeValue(SNAPSHOT_MAGIC);
+        writer.writeValue(Placement::SNAPSHOT_TAG);
+        writer.writeValue(requestsCount);
+        writer.writeValue(pendingLimit_);
+        writer.writeValue(bulkReleaseRatio_);
+        writer.writeValue(compactionThreshold_);
+        writer.writeValue(compactionSteps_);
+        writer.writeValue(compactionGap_);
+        writer.writeValue(uint64_t(cachedPartsCount_));
+        writer.writeVector(sizeClasses_);
+        writer.writeVector(cachedParts_);
+        writer.writeVector(pendingParts_);
+        memoryParts_.save(writer);
+        freeMemory_.save(writer);
+        operationsHistory_.save(writer);
+        return !writer.failed();
+    }
+
+    // Replaces the state by the snapshot in [begin, end), which must be
+    // written by a manager with the same placement. Besides the free parts
+    // of the tree placements, which are reinserted, the data are copied.
+    // Throws `InvalidSnapshotException` if the snapshot is broken: every
+    // handle and state is checked in O(n), the state is undefined then.
+    void loadSnapshot(const char* begin, const char* end) {
+        SnapshotReader reader(begin, end);
+        reader.expect(SNAPSHOT_MAGIC);
+        reader.expect(Placement::SNAPSHOT_TAG);
+        requestsCount = reader.readValue<unsigned int>();
+        pendingLimit_ = reader.readValue<int>();
+        bulkReleaseRatio_ = reader.readValue<int>();
+        compactionThreshold_ = reader.readValue<int>();
+        compactionSteps_ = reader.readValue<int>();
+        compactionGap_ = reader.readValue<MemoryPartHandle>();
+        cachedPartsCount_ = reader.readValue<uint64_t>();
+        reader.readVector(sizeClasses_);
+        reader.readVector(cachedParts_);
+        reader.readVector(pendingParts_);
+        pendingParts_.reserve(std::max(pendingLimit_, 0));
+        reader.check(cachedParts_.size() == sizeClasses_.size());
+        for (size_t i = 0; i < sizeClasses_.size(); ++i) {
+            reader.check(sizeClasses_[i] > 0 && (i == 0 || sizeClasses_[i - 1] < sizeClasses_[i]));
+        }
+        memoryParts_.load(reader);
+        freeMemory_.load(reader, memoryParts_);
+        operationsHistory_.load(reader);
+        checkLoadedParts(reader);
+    }
+
+    // Counts the parts in O(n).
+    MemoryManagerStats stats() const {
+        MemoryManagerStats result;
+        memoryParts_.forEach([&result](const MemoryPart& part) {
+            if (part.state == IS_FREE) {
+                result.freeCells += part.size;
+                ++result.freePartsCount;
+                result.largestFreePart = std::max<int64_t>(result.largestFreePart, part.size);
+                result.freePartSizes.add(part.size);
+            } else if (part.state == IS_OCCUPIED) {
+                result.usedCells += part.size;
+            } else {
+                result.deferredCells += part.size;
+            }
+        });
+        if (result.freeCells > 0) {
+            result.fragmentation = 1 - double(result.largestFreePart) / result.freeCells;
+        }
+#ifdef MEMORY_MANAGER_STATS
+        result.failedAllocations = failedAllocations_;
+        result.allocationLatency = allocationLatency_;
+        result.revocationLatency = revocationLatency_;
+#endif
+        return result;
+    }
+
+    // Returns the free parts around `offset`: the nearest one starting to the
+    // left of it and the nearest one starting at it or to the right, as
+    // (offset, size) pairs, (FAIL_CODE, 0) if there is none. O(log n).
+    // The pending parts are not included. Available for the placements
+    // derived from `OffsetOrderedPlacement`.
+    pair<MemorySize, MemorySize> freePartBefore(MemorySize offset) const {
+        return freePartPair(freeMemory_.freePartBefore(offset));
+    }
+
+    pair<MemorySize, MemorySize> freePartFrom(MemorySize offset) const {
+        return freePartPair(freeMemory_.freePartFrom(offset));
+    }
+
+    // Returns the free parts intersecting the cells [first, last)
+    // as (offset, size) pairs ordered by offset. The pending parts are not included.
+    // Available for the placements derived from `OffsetOrderedPlacement`.
+    vector<pair<MemorySize, MemorySize>> freeMemoryParts(MemorySize first, MemorySize last) const {
+        vector<MemoryPartIterator> parts;
+        freeMemory_.freePartsInRange(first, last, parts);
+
+        vector<pair<MemorySize, MemorySize>> result;
+        result.reserve(parts.size());
+        for (size_t i = 0; i < parts.size(); ++i) {
+            result.push_back(std::make_pair(MemorySize(parts[i]->offset), MemorySize(parts[i]->size)));
+        }
+        return result;
+    }
+
+private:
+    static constexpr uint64_t SNAPSHOT_MAGIC = 0x33504E534D4D454DULL;
+
+    static pair<MemorySize, MemorySize> freePartPair(MemoryPartIterator part) {
+        if (part == MemoryPartIterator()) {
+            return std::make_pair(FAIL_CODE, MemorySize(0));
+        }
+        return std::make_pair(MemorySize(part->offset), MemorySize(part->size));
+    }
+
+    // Throws `InvalidSnapshotException` unless every listed part is referred
+    // to once: a free part by the placement index, an occupied one by
+    // the operations table, and the others by their lists, so that every
+    // handle refers to a listed part in the matching state.
+    void checkLoadedParts(SnapshotReader& reader) {
+        vector<char> referred(memoryParts_.capacity(), false);
+        size_t referredCount = 0;
+        auto refer = [&](MemoryPartHandle handle, MemoryState state) {
+            reader.check(memoryParts_.isHandle(handle) && !referred[handle] &&
+                         memoryParts_.at(handle)->state == state);
+            referred[handle] = true;
+            ++referredCount;
+        };
+
+        for (size_t sizeClass = 0; sizeClass < cachedParts_.size(); ++sizeClass) {
+            for (MemoryPartHandle handle = cachedParts_[sizeClass]; handle != NO_MEMORY_PART;
+                 handle = MemoryPartHandle(memoryParts_.at(handle)->index)) {
+                refer(handle, IS_CACHED);
+                reader.check(classOf(memoryParts_.at(handle)->size) == sizeClass);
+            }
+        }
+        reader.check(referredCount == cachedPartsCount_);
+        for (size_t i = 0; i < pendingParts_.size(); ++i) {
+            refer(pendingParts_[i], IS_PENDING);
+        }
+        if (compactionGap_ != NO_MEMORY_PART) {
+            refer(compactionGap_, IS_COMPACTING);
+        }
+        operationsHistory_.forEach([&refer](const Operation& operation) {
+            refer(operation.part, IS_OCCUPIED);
+        });
+
+        size_t freePartsCount = 0;
+        size_t listedCount = 0;
+        for (MemoryPartIterator part = memoryParts_.begin(); part != memoryParts_.end(); ++part) {
+            if (part->state == IS_FREE) {
+                reader.check(freeMemory_.contains(part));
+                ++freePartsCount;
+            } else {
+                // Only the free parts may be removed from the index.
+                reader.check(referred[part.handle()] &&
+                             (part->state == IS_CACHED || part->index == OUT_OF_HEAP));
+                ++listedCount;
+            }
+        }
+        reader.check(freePartsCount == freeMemory_.size() && listedCount == referredCount);
+    }
+
+    // Splits the requested memory from the free part chosen by the placement.
+    // Returns the occupied part or the end iterator if there is no suitable part.
+    MemoryPartIterator allocatePart(MemorySize requestedMemorySize) {
+        MemoryPartIterator freePart = freeMemory_.find(requestedMemorySize);
+
+        if (freePart == memoryParts_.end()) {
+            return freePart;
+        }
+
+        if (freePart->size > requestedMemorySize) {
+            MemoryPart newMemoryPart(requestedMemorySize,
+                                     freePart->offset,
+                                     OUT_OF_HEAP,
+                                     IS_OCCUPIED);
+            // The rest of the free part keeps its place in the index.
+            freeMemory_.resize(freePart, freePart->offset + requestedMemorySize,
+                               freePart->size - requestedMemorySize);
+            return memoryParts_.insert(freePart, newMemoryPart);
+        }
+
+        freeMemory_.remove(freePart);
+        freePart->state = IS_OCCUPIED;
+        return freePart;
+    }
+
+    // Frees the part and merges it with the free neighbours.
+    // A free neighbour grows in place and keeps its place in the index.
+    void release(MemoryPartIterator part) {
+        part->state = IS_FREE;
+
+        MemoryPartIterator following = next(part);
+        bool followingIsFree = following != memoryParts_.end() && following->state == IS_FREE;
+        MemoryPartIterator previous = part;
+        bool previousIsFree = part != memoryParts_.begin() && (--previous)->state == IS_FREE;
+
+        if (previousIsFree) {
+            MemorySize size = previous->size + part->size;
+            if (followingIsFree) {
+                size += following->size;
+                freeMemory_.remove(following);
+                memoryParts_.erase(following);
+            }
+            memoryParts_.erase(part);
+            freeMemory_.resize(previous, previous->offset, size);
+        } else if (followingIsFree) {
+            freeMemory_.resize(following, part->offset, part->size + following->size);
+            memoryParts_.erase(part);
+        } else {
+            freeMemory_.insert(part);
+        }
+    }
+
+    // Returns the tail of the occupied part beyond `newSize` to the free
+    // memory. A free following part grows in place.
+    void shrinkPart(MemoryPartIterator part, MemorySize newSize) {
+        MemorySize tailSize = part->size - newSize;
+        if (tailSize == 0) {
+            return;
+        }
+
+        part->size = newSize;
+        MemoryPartIterator following = next(part);
+        if (following != memoryParts_.end() && following->state == IS_FREE) {
+            freeMemory_.resize(following, following->offset - tailSize,
+                               following->size + tailSize);
+        } else {
+            MemoryPart tail(tailSize, part->offset + newSize, OUT_OF_HEAP, IS_FREE);
+            freeMemory_.insert(memoryParts_.insert(following, tail));
+        }
+    }
+
+    // Grows the occupied part in place into the following part.
+    // Returns `false` if that is not free or too small.
+    bool growPart(MemoryPartIterator part, MemorySize newSize) {
+        MemorySize extraSize = newSize - part->size;
+        MemoryPartIterator following = next(part);
+        if (following == memoryParts_.end() || following->state != IS_FREE ||
+            following->size < extraSize) {
+            return false;
+        }
+
+        if (following->size == extraSize) {
+            freeMemory_.remove(following);
+            memoryParts_.erase(following);
+        } else {
+            freeMemory_.resize(following, following->offset + extraSize,
+                               following->size - extraSize);
+        }
+        part->size = newSize;
+        return true;
+    }
+
+    int maxClassSize() const {
+        return sizeClasses_.empty() ? -1 : sizeClasses_.back();
+    }
+
+    // Returns the smallest class not less than `size`.
+    size_t classOf(MemorySize size) const {
+        return std::lower_bound(sizeClasses_.begin(), sizeClasses_.end(), size) -
+               sizeClasses_.begin();
+    }
+
+    // The cached parts are linked by `index`, which is unused out of
+    // the placement index.
+    void pushCachedPart(MemoryPartIterator part) {
+        size_t sizeClass = classOf(part->size);
+        part->state = IS_CACHED;
+        part->index = cachedParts_[sizeClass];
+        cachedParts_[sizeClass] = part.handle();
+        ++cachedPartsCount_;
+    }
+
+    MemoryPartIterator popCachedPart(size_t sizeClass) {
+        MemoryPartIterator part = memoryParts_.at(cachedParts_[sizeClass]);
+        if (part != memoryParts_.end()) {
+            cachedParts_[sizeClass] = part->index;
+            part->index = OUT_OF_HEAP;
+            --cachedPartsCount_;
+            part->state = IS_OCCUPIED;
+        }
+        return part;
+    }
+
+    // Releases all the cached parts.
+    // Returns `true` if there was any cached part.
+    bool releaseCachedParts() {
+        bool released = false;
+        suspendOrderFor(cachedPartsCount_);
+        for (size_t sizeClass = 0; sizeClass < cachedParts_.size(); ++sizeClass) {
+            while (cachedParts_[sizeClass] != NO_MEMORY_PART) {
+                release(popCachedPart(sizeClass));
+                released = true;
+            }
+        }
+        freeMemory_.restoreOrder();
+        return released;
+    }
+
+    void pushPendingPart(MemoryPartIterator part) {
+        part->state = IS_PENDING;
+        pendingParts_.push_back(part.handle());
+        if (int(pendingParts_.size()) >= pendingLimit_) {
+            releasePendingParts();
+        }
+    }
+
+    // Merges every run of the adjacent pending parts in the list and
+    // releases the run as one part, so the placement index is updated once
+    // per run. Returns `true` if there was any pending part.
+    bool releasePendingParts() {
+        if (pendingParts_.empty()) {
+            return false;
+        }
+
+        suspendOrderFor(pendingParts_.size());
+        for (size_t i = 0; i < pendingParts_.size(); ++i) {
+            MemoryPartIterator part = memoryParts_.at(pendingParts_[i]);
+            // The part was merged into a run. No nodes are reused meanwhile,
+            // since releasing only erases them.
+            if (part->state != IS_PENDING) {
+                continue;
+            }
+
+            MemoryPartIterator previous = part;
+            while (part != memoryParts_.begin() && (--previous)->state == IS_PENDING) {
+                part = previous;
+            }
+
+            MemoryPartIterator following = next(part);
+            while (following != memoryParts_.end() && following->state == IS_PENDING) {
+                part->size += following->size;
+                following->state = IS_FREE;
+                following = memoryParts_.erase(following);
+            }
+            release(part);
+        }
+
+        pendingParts_.clear();
+        freeMemory_.restoreOrder();
+        return true;
+    }
+
+    // Suspends the order of the placement index if `releasesCount`
+    // releases are cheaper with one rebuild of the index.
+    void suspendOrderFor(size_t releasesCount) {
+        if (bulkReleaseRatio_ > 0 && releasesCount * bulkReleaseRatio_ >= freeMemory_.size()) {
+            freeMemory_.suspendOrder();
+        }
+    }
+
+    // Releases the cached and the pending parts and ends the compaction pass.
+    // Returns `true` if there was any.
+    bool releaseDeferredParts() {
+        bool released = releaseCachedParts();
+        released = releasePendingParts() || released;
+        if (compactionGap_ != NO_MEMORY_PART) {
+            endCompaction();
+            released = true;
+        }
+        return released;
+    }
+
+    // Returns the gap of the compaction pass to the free memory.
+    void endCompaction() {
+        MemoryPartIterator gap = memoryParts_.at(compactionGap_);
+        compactionGap_ = NO_MEMORY_PART;
+        if (gap->size == 0) {
+            memoryParts_.erase(gap);
+        } else {
+            release(gap);
+        }
+    }
+
+    // Starts the automatic compaction pass when there are enough free parts
+    // and advances it.
+    void advanceCompaction() {
+        if (compactionThreshold_ > 0 &&
+            (compactionGap_ != NO_MEMORY_PART ||
+             freeMemory_.size() >= size_t(compactionThreshold_))) {
+            compact(compactionSteps_);
+        }
+    }
+
+    OperationsTable<Operation> operationsHistory_;
+    MemoryPartList memoryParts_;
+    Placement freeMemory_;
+    std::pmr::vector<int> sizeClasses_;
+    // Heads of the lists of the cached parts of every size class.
+    std::pmr::vector<MemoryPartHandle> cachedParts_;
+    size_t cachedPartsCount_;
+    int pendingLimit_;
+    std::pmr::vector<MemoryPartHandle> pendingParts_;
+    int bulkReleaseRatio_;
+    int compactionThreshold_;
+    int compactionSteps_;
+    // The gap of the compaction pass or `NO_MEMORY_PART` if there is none.
+    MemoryPartHandle compactionGap_;
+    // The moves of the allocations not taken by `takeRelocations` yet.
+    vector<Relocation> relocations_;
+    unsigned int requestsCount;
+#ifdef MEMORY_MANAGER_STATS
+    uint64_t failedAllocations_ = 0;
+    Log2Histogram allocationLatency_;
+    Log2Histogram revocationLatency_;
+#endif
+};
+
+// Bitmap with summary levels: a bit of an upper level is set if the
+// corresponding word of the lower level is not zero, so the first set
+// bit is found by log_64(n) bit scans.
+class HierarchicalBitmap {
+public:
+    explicit HierarchicalBitmap(size_t size = 0) {
+        do {
+            size = (size + WORD_BITS - 1) / WORD_BITS;
+            levels_.push_back(vector<uint64_t>(std::max<size_t>(size, 1)));
+        } while (size > 1);
+    }
+
+    bool any() const {
+        return levels_.back().front() != 0;
+    }
+
+    bool test(size_t bit) const {
+        return (levels_.front()[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+    }
+
+    void set(size_t bit) {
+        for (size_t level = 0; level < levels_.size(); ++level) {
+            uint64_t& word = levels_[level][bit / WORD_BITS];
+            bool wasEmpty = word == 0;
+            word |= uint64_t(1) << (bit % WORD_BITS);
+            if (!wasEmpty) {
+                return;
+            }
+            bit /= WORD_BITS;
+        }
+    }
+
+    void reset(size_t bit) {
+        for (size_t level = 0; level < levels_.size(); ++level) {
+            uint64_t& word = levels_[level][bit / WORD_BITS];
+            word &= ~(uint64_t(1) << (bit % WORD_BITS));
+            if (word != 0) {
+                return;
+            }
+            bit /= WORD_BITS;
+        }
+    }
+
+    // Returns the first set bit, the bitmap must not be empty.
+    size_t findFirst() const {
+        size_t bit = 0;
+        for (size_t level = levels_.size(); level-- > 0; ) {
+            bit = bit * WORD_BITS + __builtin_ctzll(levels_[level][bit]);
+        }
+        return bit;
+    }
+
+private:
+    static const size_t WORD_BITS = 64;
+
+    vector<vector<uint64_t>> levels_;
+};
+
+class BuddyOperation {
+public:
+    unsigned int id;
+    int order;
+    // The block is [block * 2^order, (block + 1) * 2^order) in cells from 0.
+    // The index takes more than 32 bits in the memories of over 2^32 cells.
+    uint64_t block;
+
+    BuddyOperation()
+        : id(NO_OPERATION),
+          order(0),
+          block(0)
+    {}
+
+    BuddyOperation(unsigned int id, uint64_t block, int order)
+        : id(id),
+          order(order),
+          block(block)
+    {}
+};
+
+// Binary buddy allocator over the memory cells [1, memorySize], serves the
+// same requests as `MemoryManager`. An allocation takes the lowest free
+// aligned block of the smallest sufficient order 2^k (at least
+// 2^minOrder), splitting a larger block if needed, and a revoked block is
+// merged with its free buddies. Both take O(log memorySize) bit scans.
+// The memory is covered by the largest aligned blocks fitting in it, so an
+// allocation fails if it is larger than the largest such block even when
+// there are enough free cells; the cells after the last block of 2^minOrder
+// are never used.
+// The free blocks of every order are kept in a bitmap of 2^(K - order)
+// bits, where 2^K >= memorySize, so larger `minOrder` saves memory.
+class BuddyMemoryManager {
+public:
+    explicit BuddyMemoryManager(MemorySize memorySize, int minOrder = 0)
+        : minOrder_(minOrder),
+          maxOrder_(minOrder),
+          nonEmptyOrders_(0),
+          requestsCount(0)
+    {
+        while ((int64_t(1) << maxOrder_) < memorySize) {
+            ++maxOrder_;
+        }
+        for (int order = 0; order <= maxOrder_; ++order) {
+            size_t blocksCount = order < minOrder_ ? 0 : size_t(1) << (maxOrder_ - order);
+            freeBlocks_.push_back(HierarchicalBitmap(blocksCount));
+        }
+
+        int64_t firstCell = 0;
+        for (int order = maxOrder_; order >= minOrder_; --order) {
+            if (firstCell + (int64_t(1) << order) <= memorySize) {
+                pushFreeBlock(order, firstCell >> order);
+                firstCell += int64_t(1) << order;
+            }
+        }
+    }
+
+    // Revokes the request for memory allocating.
+    // Takes the number of request for revoking.
+    void revoke(size_t requestNumber) {
+        ++requestsCount;
+        BuddyOperation* operationForRevoke = operationsHistory_.find(requestNumber);
+
+        if (operationForRevoke == nullptr) {
+            return;
+        }
+
+        size_t block = operationForRevoke->block;
+        int order = operationForRevoke->order;
+        operationsHistory_.erase(operationForRevoke);
+        freeBlock(block, order);
+    }
+
+    // Tries to allocate memory of the given size.
+    // Returns the offset of the allocated memory part in success,
+    // else returns -1.
+    MemorySize allocate(MemorySize requestedMemorySize) {
+        ++requestsCount;
+        int order = orderOf(requestedMemorySize);
+        size_t block = allocateBlock(order);
+        if (block == NO_BLOCK) {
+            return FAIL_CODE;
+        }
+
+        BuddyOperation operation(requestsCount, block, order);
+        operationsHistory_.insert(operation);
+        return (block << order) + 1;
+    }
+
+    // Reallocates like `MemoryManager::reallocate`. The block shrinks in
+    // place by freeing its upper halves, grows in place while it is the
+    // lower half of a free buddy, else moves. Fails on a negative size.
+    MemorySize reallocate(size_t requestNumber, MemorySize newMemorySize) {
+        ++requestsCount;
+        BuddyOperation* operation = operationsHistory_.find(requestNumber);
+        if (operation == nullptr || newMemorySize < 0) {
+            return FAIL_CODE;
+        }
+        int newOrder = orderOf(newMemorySize);
+        if (newOrder > maxOrder_) {
+            return FAIL_CODE;
+        }
+
+        size_t block = operation->block;
+        int order = operation->order;
+        while (order > newOrder) {
+            --order;
+            block *= 2;
+            pushFreeBlock(order, block + 1);
+        }
+        if (order < newOrder && canGrowInPlace(block, order, newOrder)) {
+            for (; order < newOrder; ++order) {
+                popFreeBlock(order, block ^ 1);
+                block /= 2;
+            }
+        }
+        if (order < newOrder) {
+            size_t movedBlock = allocateBlock(newOrder);
+            if (movedBlock == NO_BLOCK) {
+                return FAIL_CODE;
+            }
+            freeBlock(block, order);
+            block = movedBlock;
+        }
+
+        operation->block = block;
+        operation->order = newOrder;
+        return (block << newOrder) + 1;
+    }
+
+    // Processes the requests like `MemoryManager::process`.
+    size_t process(const int* rawRequests, size_t count, MemorySize* results) {
+        MemorySize* result = results;
+        for (size_t i = 0; i < count; ++i) {
+            if (rawRequests[i] >= 0) {
+                *result++ = allocate(rawRequests[i]);
+            } else if (rawRequests[i] != REALLOCATION_CODE) {
+                revoke(-rawRequests[i]);
+            } else {
+                if (i + REALLOCATION_LENGTH <= count) {
+                    *result++ = reallocate(rawRequests[i + 1], rawRequests[i + 2]);
+                }
+                i += REALLOCATION_LENGTH - 1;
+            }
+        }
+        return result - results;
+    }
+
+private:
+    static constexpr size_t NO_BLOCK = std::numeric_limits<size_t>::max();
+
+    // Returns the smallest order holding `size` cells, may be over `maxOrder_`.
+    int orderOf(MemorySize size) const {
+        int order = minOrder_;
+        while ((int64_t(1) << order) < size) {
+            ++order;
+        }
+        return order;
+    }
+
+    // Splits a free block of the order from the smallest larger free one.
+    // Returns the block or `NO_BLOCK` if there is none.
+    size_t allocateBlock(int order) {
+        if (order > maxOrder_ || (nonEmptyOrders_ >> order) == 0) {
+            return NO_BLOCK;
+        }
+
+        int freeOrder = order + __builtin_ctzll(nonEmptyOrders_ >> order);
+        size_t block = freeBlocks_[freeOrder].findFirst();
+        popFreeBlock(freeOrder, block);
+        while (freeOrder > order) {
+            --freeOrder;
+            block *= 2;
+            pushFreeBlock(freeOrder, block + 1);
+        }
+        return block;
+    }
+
+    // Frees the block and merges it with the free buddies.
+    void freeBlock(size_t block, int order) {
+        while (order < maxOrder_ && freeBlocks_[order].test(block ^ 1)) {
+            popFreeBlock(order, block ^ 1);
+            block /= 2;
+            ++order;
+        }
+        pushFreeBlock(order, block);
+    }
+
+    // Returns `true` if the block is the lower half of a free buddy
+    // on every order from `order` up to `newOrder`.
+    bool canGrowInPlace(size_t block, int order, int newOrder) const {
+        for (; order < newOrder; ++order, block /= 2) {
+            if (block % 2 != 0 || !freeBlocks_[order].test(block ^ 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void pushFreeBlock(int order, size_t block) {
+        freeBlocks_[order].set(block);
+        nonEmptyOrders_ |= uint64_t(1) << order;
+    }
+
+    void popFreeBlock(int order, size_t block) {
+        freeBlocks_[order].reset(block);
+        if (!freeBlocks_[order].any()) {
+            nonEmptyOrders_ &= ~(uint64_t(1) << order);
+        }
+    }
+
+    OperationsTable<BuddyOperation> operationsHistory_;
+    vector<HierarchicalBitmap> freeBlocks_;
+    int minOrder_;
+    int maxOrder_;
+    // Bit k is set if there is a free block of order k.
+    uint64_t nonEmptyOrders_;
+    unsigned int requestsCount;
+};
+
+// Bounded lock-free queue for many producers and one consumer
+// (D. Vyukov's bounded MPMC queue). Every cell has a sequence number
+// telling whether it is ready for the next push or pop.
+template <class T>
+class MpscQueue {
+public:
+    // `capacity` must be a power of two.
+    explicit MpscQueue(size_t capacity)
+        : cells_(new Cell[capacity]),
+          mask_(capacity - 1),
+          pushPosition_(0),
+          popPosition_(0)
+    {
+        for (size_t i = 0; i < capacity; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns `false` if the queue is full.
+    bool push(const T& value) {
+        size_t position = pushPosition_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[position & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference = intptr_t(sequence) - intptr_t(position);
+            if (difference == 0) {
+                if (pushPosition_.compare_exchange_weak(position, position + 1,
+                                                        std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = pushPosition_.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = value;
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Must not be called concurrently with itself.
+    // Returns `false` if the queue is empty.
+    bool pop(T& value) {
+        Cell& cell = cells_[popPosition_ & mask_];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if (intptr_t(sequence) - intptr_t(popPosition_ + 1) < 0) {
+            return false;
+        }
+
+        value = cell.value;
+        cell.sequence.store(popPosition_ + mask_ + 1, std::memory_order_release);
+        ++popPosition_;
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> pushPosition_;
+    alignas(64) size_t popPosition_;
+};
+
+// Bounded lock-free queue for one producer and one consumer.
+template <class T>
+class SpscQueue {
+public:
+    // `capacity` must be a power of two.
+    explicit SpscQueue(size_t capacity)
+        : values_(capacity),
+          mask_(capacity - 1),
+          pushPosition_(0),
+          popPosition_(0)
+    {}
+
+    // Returns `false` if the queue is full.
+    bool push(const T& value) {
+        size_t position = pushPosition_.load(std::memory_order_relaxed);
+        if (position - popPosition_.load(std::memory_order_acquire) > mask_) {
+            return false;
+        }
+        values_[position & mask_] = value;
+        pushPosition_.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns `false` if the queue is empty.
+    bool pop(T& value) {
+        size_t position = popPosition_.load(std::memory_order_relaxed);
+        if (position == pushPosition_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = values_[position & mask_];
+        popPosition_.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Waits until there is room for the value.
+    void pushWaiting(const T& value) {
+        while (!push(value)) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Waits until there is a value.
+    T popWaiting() {
+        T value;
+        while (!pop(value)) {
+            std::this_thread::yield();
+        }
+        return value;
+    }
+
+private:
+    vector<T> values_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> pushPosition_;
+    alignas(64) std::atomic<size_t> popPosition_;
+};
+
+// Returns `memorySize * part / parts` rounded down. The product is taken
+// in 128 bits, so it doesn't overflow for any number of parts.
+MemorySize ProportionalCells(MemorySize memorySize, uint64_t part, uint64_t parts) {
+    return MemorySize(static_cast<__int128>(memorySize) * part / parts);
+}
+
+// Thread-safe memory manager splitting the memory into shards, each one
+// with its own `MemoryManager` (heap and memory parts list) and lock.
+// A thread allocates from its home shard and steals from the others when
+// the home shard has no suitable part. Allocations are identified by
+// handles keeping the shard, and a revocation is posted to the lock-free
+// queue of the owning shard, which is drained by whoever locks the shard
+// next, so revoking never waits for a lock.
+class ShardedMemoryManager {
+public:
+    typedef uint64_t Handle;
+
+    struct Allocation {
+        // `FAIL_CODE` if the allocation failed.
+        MemorySize offset;
+        Handle handle;
+    };
+
+    // Zero shards are taken as one.
+    ShardedMemoryManager(MemorySize memorySize, size_t shardsCount) {
+        shardsCount = std::max<size_t>(shardsCount, 1);
+        for (size_t shard = 0; shard < shardsCount; ++shard) {
+            MemorySize firstCell = 1 + ProportionalCells(memorySize, shard, shardsCount);
+            MemorySize lastCell = ProportionalCells(memorySize, shard + 1, shardsCount);
+            shards_.emplace_back(new Shard(lastCell - firstCell + 1, firstCell));
+        }
+    }
+
+    size_t shardsCount() const {
+        return shards_.size();
+    }
+
+    // Allocates memory for the thread with the given index.
+    Allocation allocate(size_t threadIndex, MemorySize requestedMemorySize) {
+        size_t home = threadIndex % shards_.size();
+        Allocation allocation;
+
+        // Steals without waiting first, then waits for the busy shards.
+        for (int pass = 0; pass < 2; ++pass) {
+            for (size_t i = 0; i < shards_.size(); ++i) {
+                size_t shard = (home + i) % shards_.size();
+                std::unique_lock<std::mutex> lock(shards_[shard]->mutex, std::defer_lock);
+                if (shard == home || pass == 1) {
+                    lock.lock();
+                } else if (!lock.try_lock()) {
+                    continue;
+                }
+
+                if (allocateFromShard(shard, requestedMemorySize, allocation)) {
+                    return allocation;
+                }
+            }
+        }
+
+        allocation.offset = FAIL_CODE;
+        allocation.handle = 0;
+        return allocation;
+    }
+
+    // Revokes the allocation, can be called from any thread.
+    void revoke(Handle handle) {
+        Shard& shard = *shards_[handle % shards_.size()];
+        unsigned int requestNumber = handle / shards_.size();
+
+        if (!shard.revocations.push(requestNumber)) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            drainRevocations(shard);
+            shard.manager.revoke(requestNumber);
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(shard.mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            drainRevocations(shard);
+        }
+    }
+
+private:
+    static const size_t REVOCATIONS_CAPACITY = 1 << 12;
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        MemoryManager<> manager;
+        MpscQueue<unsigned int> revocations;
+
+        Shard(MemorySize memorySize, MemorySize firstCell)
+            : manager(memorySize, optionsFrom(firstCell)),
+              revocations(REVOCATIONS_CAPACITY)
+        {}
+
+        static MemoryManagerOptions optionsFrom(MemorySize firstCell) {
+            MemoryManagerOptions options;
+            options.firstCell = firstCell;
+            return options;
+        }
+    };
+
+    // The shard must be locked.
+    bool allocateFromShard(size_t shardIndex, MemorySize requestedMemorySize,
+                           Allocation& allocation) {
+        Shard& shard = *shards_[shardIndex];
+        drainRevocations(shard);
+
+        allocation.offset = shard.manager.allocate(requestedMemorySize);
+        allocation.handle = Handle(shard.manager.lastRequestNumber()) * shards_.size() + shardIndex;
+        return allocation.offset != FAIL_CODE;
+    }
+
+    // The shard must be locked.
+    void drainRevocations(Shard& shard) {
+        unsigned int requestNumber;
+        while (shard.revocations.pop(requestNumber)) {
+            shard.manager.revoke(requestNumber);
+        }
+    }
+
+    vector<std::unique_ptr<Shard>> shards_;
+};
+
+// `std::pmr::memory_resource` handing out the memory of a byte buffer,
+// either given by the caller or mapped by the resource itself. Each cell
+// of the `MemoryManager` is `GRANULE` bytes, so the blocks are aligned to
+// `GRANULE`, and a larger alignment is reached by allocating more cells.
+// The blocks are found by the cell of their pointer in the operations
+// table, so deallocating takes O(1) besides the merging. Not thread-safe.
+template <class Placement = WorstFitPlacement>
+class BufferMemoryResource : public std::pmr::memory_resource {
+public:
+    static const size_t GRANULE = alignof(std::max_align_t);
+
+    // Manages [buffer, buffer + size), which must outlive the resource.
+    BufferMemoryResource(void* buffer, size_t size,
+                         const MemoryManagerOptions& options = MemoryManagerOptions())
+        : base_(alignUp(static_cast<char*>(buffer), GRANULE)),
+          mapping_(nullptr),
+          mappingSize_(0),
+          manager_(cellsIn(size - std::min<size_t>(size, base_ - static_cast<char*>(buffer))),
+                   options)
+    {}
+
+    // Manages `size` bytes of new anonymous memory mapping.
+    explicit BufferMemoryResource(size_t size,
+                                  const MemoryManagerOptions& options = MemoryManagerOptions())
+        : base_(static_cast<char*>(mapMemory(size))),
+          mapping_(base_),
+          mappingSize_(size),
+          manager_(cellsIn(size), options)
+    {}
+
+    ~BufferMemoryResource() {
+        if (mapping_ != nullptr) {
+            munmap(mapping_, mappingSize_);
+        }
+    }
+
+    BufferMemoryResource(const BufferMemoryResource&) = delete;
+    BufferMemoryResource& operator=(const BufferMemoryResource&) = delete;
+
+    // Returns the number of the live blocks.
+    size_t blocksCount() const {
+        return blocks_.size();
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        size_t padding = alignment > GRANULE ? alignment - GRANULE : 0;
+        // Compared before adding, so the huge sizes don't wrap around.
+        if (bytes > std::numeric_limits<size_t>::max() - padding - GRANULE) {
+            throw std::bad_alloc();
+        }
+        MemorySize cells = (std::max<size_t>(bytes, 1) + padding + GRANULE - 1) / GRANULE;
+
+        MemoryPartHandle block = manager_.allocateBlock(cells);
+        if (block == NO_MEMORY_PART) {
+            throw std::bad_alloc();
+        }
+        char* pointer = alignUp(cellPointer(manager_.blockOffset(block)), alignment);
+        blocks_.insert(Operation(cellOf(pointer), block));
+        return pointer;
+    }
+
+    void do_deallocate(void* pointer, size_t /* bytes */, size_t /* alignment */) override {
+        Operation* block = blocks_.find(cellOf(static_cast<char*>(pointer)));
+        if (block != nullptr) {
+            manager_.freeBlock(block->part);
+            blocks_.erase(block);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    static char* alignUp(char* pointer, size_t alignment) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(pointer);
+        return pointer + (alignment - address % alignment) % alignment;
+    }
+
+    // The blocks are keyed by 32-bit cells, which limits the resource to
+    // 2^32 - 1 cells.
+    static MemorySize cellsIn(size_t bytes) {
+        return std::min<size_t>(bytes / GRANULE, std::numeric_limits<unsigned int>::max());
+    }
+
+    static void* mapMemory(size_t size) {
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        return memory;
+    }
+
+    // The cells are numbered from 1.
+    char* cellPointer(MemorySize cell) const {
+        return base_ + size_t(cell - 1) * GRANULE;
+    }
+
+    unsigned int cellOf(const char* pointer) const {
+        return (pointer - base_) / GRANULE + 1;
+    }
+
+    char* base_;
+    void* mapping_;
+    size_t mappingSize_;
+    MemoryManager<Placement> manager_;
+    // The blocks by the cells of their pointers.
+    OperationsTable<Operation> blocks_;
+};
+
+// Request decoded from the input: the allocation of `value` cells,
+// the revocation of the request number `value` or its reallocation
+// to `size` cells.
+struct RawRequest {
+    RequestType type;
+    int value;
+    int size;
+};
+
+// Decodes the input encoding: a non-negative number is the size of an
+// allocation, a negative one is the number of the revoked request.
+RawRequest DecodeRequest(int rawRequest) {
+    RawRequest request;
+    request.size = 0;
+    if (rawRequest >= 0) {
+        request.type = ALLOCATION;
+        request.value = rawRequest;
+    } else {
+        request.type = REVOCATION;
+        request.value = -rawRequest;
+    }
+    return request;
+}
+
+// Decodes the request at the beginning of the raw requests.
+RawRequest DecodeRequest(const int* rawRequest) {
+    if (rawRequest[0] != REALLOCATION_CODE) {
+        return DecodeRequest(rawRequest[0]);
+    }
+    RawRequest request;
+    request.type = REALLOCATION;
+    request.value = rawRequest[1];
+    request.size = rawRequest[2];
+    return request;
+}
+
+// Reads whitespace separated integers from a file through a large buffer,
+// or from a memory range. Does no allocations after the construction.
+class InputReader {
+public:
+    explicit InputReader(FILE* file)
+        : file_(file),
+          buffer_(BUFFER_SIZE),
+          current_(buffer_.data()),
+          end_(buffer_.data())
+    {}
+
+    InputReader(const char* begin, const char* end)
+        : file_(nullptr),
+          current_(begin),
+          end_(end)
+    {}
+
+    // Reads the next integer. Returns `false` at the end of the input, or
+    // if there is no number or it does not fit into `Integer`.
+    template <class Integer>
+    bool readInt(Integer& value) {
+        typedef typename std::make_unsigned<Integer>::type Unsigned;
+
+        int symbol = skipSpaces();
+        if (symbol == EOF) {
+            return false;
+        }
+
+        bool negative = symbol == '-';
+        if (negative) {
+            ++current_;
+        }
+
+        const Unsigned limit = static_cast<Unsigned>(std::numeric_limits<Integer>::max()) +
+                               (negative ? 1 : 0);
+        Unsigned absolute = 0;
+        bool hasDigits = false;
+        while ((symbol = peek()) >= '0' && symbol <= '9') {
+            Unsigned digit = symbol - '0';
+            if (absolute > (limit - digit) / 10) {
+                return false;
+            }
+            absolute = absolute * 10 + digit;
+            hasDigits = true;
+            ++current_;
+        }
+        if (!hasDigits) {
+            return false;
+        }
+
+        if (!negative) {
+            value = static_cast<Integer>(absolute);
+        } else {
+            value = absolute == 0 ? 0 : -static_cast<Integer>(absolute - 1) - 1;
+        }
+        return true;
+    }
+
+    // Reads the next request in the raw encoding to `rawRequest`, which
+    // must have room for `REALLOCATION_LENGTH` numbers. A reallocation is
+    // written as `@<request number> <new size>`.
+    // Returns the count of the read numbers, zero at the end of the input
+    // or at a malformed request. `REALLOCATION_CODE` written as a number is
+    // malformed, as it would be taken for a reallocation.
+    size_t readRawRequest(int* rawRequest) {
+        if (skipSpaces() != '@') {
+            return readInt(rawRequest[0]) && rawRequest[0] != REALLOCATION_CODE ? 1 : 0;
+        }
+        ++current_;
+        rawRequest[0] = REALLOCATION_CODE;
+        return readInt(rawRequest[1]) && readInt(rawRequest[2]) ? REALLOCATION_LENGTH : 0;
+    }
+
+    // Reads the next request. Returns `false` at the end of the input.
+    bool readRequest(RawRequest& request) {
+        int rawRequest[REALLOCATION_LENGTH];
+        if (readRawRequest(rawRequest) == 0) {
+            return false;
+        }
+        request = DecodeRequest(rawRequest);
+        return true;
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 1 << 16;
+
+    // Returns the current symbol or `EOF`.
+    int peek() {
+        if (current_ == end_ && !refill()) {
+            return EOF;
+        }
+        return static_cast<unsigned char>(*current_);
+    }
+
+    int skipSpaces() {
+        int symbol = peek();
+        while (symbol != EOF && std::isspace(symbol)) {
+            ++current_;
+            symbol = peek();
+        }
+        return symbol;
+    }
+
+    bool refill() {
+        if (file_ == nullptr) {
+            return false;
+        }
+        size_t read = std::fread(buffer_.data(), 1, buffer_.size(), file_);
+        current_ = buffer_.data();
+        end_ = current_ + read;
+        return read > 0;
+    }
+
+    FILE* file_;
+    vector<char> buffer_;
+    const char* current_;
+    const char* end_;
+};
+
+// Writes integers to a file through a large buffer, one per line.
+class OutputWriter {
+public:
+    explicit OutputWriter(FILE* file)
+        : file_(file),
+          buffer_(BUFFER_SIZE),
+          size_(0)
+    {}
+
+    OutputWriter(const OutputWriter&) = delete;
+    OutputWriter& operator=(const OutputWriter&) = delete;
+
+    ~OutputWriter() {
+        flush();
+    }
+
+    void writeLine(int64_t value) {
+        if (size_ + MAX_LINE_LENGTH > buffer_.size()) {
+            flush();
+        }
+
+        char digits[MAX_LINE_LENGTH];
+        int length = 0;
+        uint64_t absolute = value < 0 ? 0u - uint64_t(value) : value;
+        do {
+            digits[length++] = '0' + absolute % 10;
+            absolute /= 10;
+        } while (absolute > 0);
+
+        if (value < 0) {
+            buffer_[size_++] = '-';
+        }
+        while (length > 0) {
+            buffer_[size_++] = digits[--length];
+        }
+        buffer_[size_++] = '\n';
+    }
+
+    void flush() {
+        std::fwrite(buffer_.data(), 1, size_, file_);
+        std::fflush(file_);
+        size_ = 0;
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 1 << 16;
+    static const size_t MAX_LINE_LENGTH = 24;
+
+    FILE* file_;
+    vector<char> buffer_;
+    size_t size_;
+};
+
+// Read-only mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const string& path)
+        : data_(nullptr),
+          size_(0)
+    {
+        int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            return;
+        }
+        struct stat status;
+        if (fstat(descriptor, &status) == 0) {
+            if (status.st_size == 0) {
+                // An empty file can't be mapped, but it is valid.
+                data_ = "";
+            } else {
+                void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+                if (data != MAP_FAILED) {
+                    data_ = static_cast<const char*>(data);
+                    size_ = status.st_size;
+                    madvise(data, size_, MADV_SEQUENTIAL);
+                }
+            }
+        }
+        close(descriptor);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (size_ > 0) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    bool valid() const {
+        return data_ != nullptr;
+    }
+
+    const char* begin() const {
+        return data_;
+    }
+
+    const char* end() const {
+        return data_ + size_;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+};
+
+// Requests of a trace. In the binary format they are
+// read in place from the mapping: the 8-byte magic, the memory size and
+// the number of the requests as 64-bit integers, then the raw requests.
+struct Trace {
+    MemorySize memorySize;
+    // The `count` numbers of the requests in the raw encoding.
+    const int* requests;
+    size_t count;
+    // Holds the requests parsed from the text format.
+    vector<int> parsedRequests;
+};
+
+const uint64_t BINARY_TRACE_MAGIC = 0x3245434152544D4DULL;
+const size_t BINARY_TRACE_HEADER_SIZE = 24;
+
+// Reads the trace in the text or in the binary format from `file`,
+// which must outlive `trace`. Returns `false` if the trace is broken.
+bool ReadTrace(const MappedFile& file, Trace& trace) {
+    size_t size = file.end() - file.begin();
+    uint64_t magic = 0;
+    if (size >= BINARY_TRACE_HEADER_SIZE) {
+        std::memcpy(&magic, file.begin(), sizeof(magic));
+    }
+
+    if (magic == BINARY_TRACE_MAGIC) {
+        int64_t header[2];
+        std::memcpy(header, file.begin() + sizeof(magic), sizeof(header));
+        trace.memorySize = header[0];
+        trace.requests = reinterpret_cast<const int*>(file.begin() + BINARY_TRACE_HEADER_SIZE);
+        trace.count = header[1];
+        return header[0] >= 0 && header[0] <= MAX_MEMORY_SIZE && header[1] >= 0 &&
+               trace.count <= (size - BINARY_TRACE_HEADER_SIZE) / sizeof(int32_t);
+    }
+
+    InputReader input(file.begin(), file.end());
+    int requestsCount = 0;
+    if (!input.readInt(trace.memorySize) || trace.memorySize < 0 ||
+        trace.memorySize > MAX_MEMORY_SIZE || !input.readInt(requestsCount) || requestsCount < 0) {
+        return false;
+    }
+    trace.parsedRequests.reserve(requestsCount);
+    for (int i = 0; i < requestsCount; ++i) {
+        int rawRequest[REALLOCATION_LENGTH];
+        size_t length = input.readRawRequest(rawRequest);
+        if (length == 0) {
+            return false;
+        }
+        trace.parsedRequests.insert(trace.parsedRequests.end(), rawRequest, rawRequest + length);
+    }
+    trace.requests = trace.parsedRequests.data();
+    trace.count = trace.parsedRequests.size();
+    return true;
+}
+
+// Writes the trace in the binary format. Returns `false` if the writing failed.
+bool WriteBinaryTrace(const Trace& trace, FILE* file) {
+    int64_t header[2] = {trace.memorySize, int64_t(trace.count)};
+    return std::fwrite(&BINARY_TRACE_MAGIC, sizeof(BINARY_TRACE_MAGIC), 1, file) == 1 &&
+           std::fwrite(header, sizeof(header), 1, file) == 1 &&
+           std::fwrite(trace.requests, sizeof(int32_t), trace.count, file) == trace.count;
+}
+
+template <class Manager>
+int processRequest(Manager& memoryManager, const RawRequest& request) {
+    switch (request.type) {
+    case ALLOCATION:
+        return memoryManager.allocate(request.value);
+    case REVOCATION:
+        memoryManager.revoke(request.value);
+        return 0;
+    case REALLOCATION:
+        return memoryManager.reallocate(request.value, request.size);
+    default:
+        throw UnknownRequestTypeException();
+    }
+}
+
+void TestAll();
+
+const size_t REQUESTS_BATCH_SIZE = 4096;
+// The room for the numbers of a batch, the last request may be a reallocation.
+const size_t RAW_REQUESTS_BATCH_CAPACITY = REQUESTS_BATCH_SIZE + REALLOCATION_LENGTH - 1;
+
+// The number of the batches going round in `ProcessRequestsPipelined`.
+const size_t PIPELINE_BATCHES_COUNT = 8;
+
+// Reads the requests to `rawRequests` until there are `REQUESTS_BATCH_SIZE`
+// numbers, but not more than `requestsLeft` requests in total, which is
+// decreased. Returns the count of the read numbers.
+size_t ReadRawRequests(InputReader& input, int* rawRequests, int& requestsLeft) {
+    size_t count = 0;
+    while (count < REQUESTS_BATCH_SIZE && requestsLeft > 0) {
+        size_t length = input.readRawRequest(rawRequests + count);
+        if (length == 0) {
+            // The end of the input or a malformed number: stop reading.
+            requestsLeft = 0;
+            break;
+        }
+        count += length;
+        --requestsLeft;
+    }
+    return count;
+}
+
+// Returns the end of the batch of the raw requests from `begin`, which has
+// about `REQUESTS_BATCH_SIZE` numbers and doesn't cut a reallocation.
+size_t RawRequestsBatchEnd(const int* rawRequests, size_t begin, size_t count) {
+    size_t end = begin;
+    while (end < count && end - begin < REQUESTS_BATCH_SIZE) {
+        end += RawRequestLength(rawRequests[end]);
+    }
+    return std::min(end, count);
+}
+
+// Processes `requestNumber` requests from `input` with `memoryManager`,
+// prints the results of the allocations to `output`.
+// The requests are processed in batches of `REQUESTS_BATCH_SIZE`.
+template <class Manager>
+void ProcessRequests(Manager& memoryManager, int requestNumber,
+                     InputReader& input, OutputWriter& output) {
+    vector<int> rawRequests(RAW_REQUESTS_BATCH_CAPACITY);
+    vector<MemorySize> results(REQUESTS_BATCH_SIZE);
+
+    while (true) {
+        size_t count = ReadRawRequests(input, rawRequests.data(), requestNumber);
+        if (count == 0) {
+            break;
+        }
+
+        size_t resultsCount = memoryManager.process(rawRequests.data(), count, results.data());
+        for (size_t i = 0; i < resultsCount; ++i) {
+            output.writeLine(results[i]);
+        }
+    }
+}
+
+// Processes the requests like `ProcessRequests`, but parses the input and
+// formats the results in separate threads, which are connected with the
+// thread of the memory manager by lock-free queues of batches. The batches
+// go round from the parser to the memory manager, to the formatter and
+// back to the parser, so the results are printed in order and nothing is
+// allocated after the start.
+template <class Manager>
+void ProcessRequestsPipelined(Manager& memoryManager, int requestNumber,
+                              InputReader& input, OutputWriter& output) {
+    struct Batch {
+        vector<int> rawRequests;
+        vector<MemorySize> results;
+        // Zero for the last batch.
+        size_t count;
+        size_t resultsCount;
+    };
+
+    const size_t batchesCount = PIPELINE_BATCHES_COUNT;
+    vector<Batch> batches(batchesCount);
+    SpscQueue<Batch*> freeBatches(batchesCount);
+    SpscQueue<Batch*> parsedBatches(batchesCount);
+    SpscQueue<Batch*> processedBatches(batchesCount);
+    for (size_t i = 0; i < batchesCount; ++i) {
+        batches[i].rawRequests.resize(RAW_REQUESTS_BATCH_CAPACITY);
+        batches[i].results.resize(REQUESTS_BATCH_SIZE);
+        freeBatches.push(&batches[i]);
+    }
+
+    // A batch belongs to the next stage as soon as it is pushed, so every
+    // stage copies the count before pushing the batch on.
+    std::thread parser([&] {
+        size_t count;
+        do {
+            Batch* batch = freeBatches.popWaiting();
+            count = ReadRawRequests(input, batch->rawRequests.data(), requestNumber);
+            batch->count = count;
+            parsedBatches.pushWaiting(batch);
+        } while (count > 0);
+    });
+
+    std::thread allocator([&] {
+        size_t count;
+        do {
+            Batch* batch = parsedBatches.popWaiting();
+            count = batch->count;
+            batch->resultsCount = memoryManager.process(batch->rawRequests.data(), count,
+                                                        batch->results.data());
+            processedBatches.pushWaiting(batch);
+        } while (count > 0);
+    });
+
+    size_t count;
+    do {
+        Batch* batch = processedBatches.popWaiting();
+        count = batch->count;
+        for (size_t i = 0; i < batch->resultsCount; ++i) {
+            output.writeLine(batch->results[i]);
+        }
+        freeBatches.pushWaiting(batch);
+    } while (count > 0);
+
+    parser.join();
+    allocator.join();
+}
+
+// The memory manager chosen by the command line.
+struct EngineSettings {
+    // "heap" for `MemoryManager` or "buddy" for `BuddyMemoryManager`.
+    string engine;
+    string placement;
+    MemoryManagerOptions options;
+    int buddyMinOrder;
+
+    EngineSettings()
+        : engine("heap"),
+          placement("worst-fit"),
+          buddyMinOrder(0)
+    {}
+
+    bool valid() const {
+        if (engine == "buddy") {
+            return buddyMinOrder >= 0 && buddyMinOrder < 31;
+        }
+        return engine == "heap" &&
+               (placement == "worst-fit" || placement == "best-fit" ||
+                placement == "first-fit" || placement == "next-fit");
+    }
+};
+
+// Creates the memory manager chosen by the valid `settings`
+// and calls `action` with it.
+template <class Action>
+void RunWithMemoryManager(const EngineSettings& settings, MemorySize memorySize,
+                          Action action) {
+    if (settings.engine == "buddy") {
+        BuddyMemoryManager memoryManager(memorySize, settings.buddyMinOrder);
+        action(memoryManager);
+    } else if (settings.placement == "worst-fit") {
+        MemoryManager<WorstFitPlacement> memoryManager(memorySize, settings.options);
+        action(memoryManager);
+    } else if (settings.placement == "best-fit") {
+        MemoryManager<BestFitPlacement> memoryManager(memorySize, settings.options);
+        action(memoryManager);
+    } else if (settings.placement == "first-fit") {
+        MemoryManager<FirstFitPlacement> memoryManager(memorySize, settings.options);
+        action(memoryManager);
+    } else {
+        MemoryManager<NextFitPlacement> memoryManager(memorySize, settings.options);
+        action(memoryManager);
+    }
+}
+
+template <class Placement>
+bool SaveSnapshot(const MemoryManager<Placement>& memoryManager, const string& path) {
+    FILE* file = std::fopen(path.c_str(), "wb");
+    bool saved = file != nullptr && memoryManager.saveSnapshot(file);
+    saved = file != nullptr && std::fclose(file) == 0 && saved;
+    if (!saved) {
+        cerr << "can't write the snapshot to " << path << endl;
+    }
+    return saved;
+}
+
+template <class Placement>
+bool LoadSnapshot(MemoryManager<Placement>& memoryManager, const string& path) {
+    MappedFile file(path);
+    if (!file.valid()) {
+        cerr << "can't read the snapshot from " << path << endl;
+        return false;
+    }
+    try {
+        memoryManager.loadSnapshot(file.begin(), file.end());
+    } catch (const InvalidSnapshotException& exception) {
+        cerr << path << ": " << exception.what() << endl;
+        return false;
+    }
+    return true;
+}
+
+bool SaveSnapshot(const BuddyMemoryManager& /* memoryManager */, const string& /* path */) {
+    cerr << "no snapshots for the buddy engine" << endl;
+    return false;
+}
+
+bool LoadSnapshot(BuddyMemoryManager& /* memoryManager */, const string& /* path */) {
+    cerr << "no snapshots for the buddy engine" << endl;
+    return false;
+}
+
+template <class Placement>
+void PrintManagerStats(const MemoryManager<Placement>& memoryManager) {
+    PrintStats(cerr, memoryManager.stats());
+}
+
+void PrintManagerStats(const BuddyMemoryManager& /* memoryManager */) {
+    cerr << "no statistics for the buddy engine" << endl;
+}
+
+// Measures the throughput of `ShardedMemoryManager` with a shard per thread
+// on a mixed workload: every thread allocates random sizes and revokes
+// random live allocations, a quarter of the revocations is handed over
+// to the next thread. Returns the number of operations per second.
+double BenchmarkShardedMemoryManager(size_t threadsCount, size_t operationsPerThread) {
+    const int memoryPerThread = 1 << 22;
+    const size_t maxLiveAllocations = 1024;
+    ShardedMemoryManager memoryManager(memoryPerThread * threadsCount, threadsCount);
+    vector<std::unique_ptr<MpscQueue<ShardedMemoryManager::Handle>>> inboxes;
+    for (size_t thread = 0; thread < threadsCount; ++thread) {
+        inboxes.emplace_back(new MpscQueue<ShardedMemoryManager::Handle>(1 << 12));
+    }
+
+    auto work = [&](size_t threadIndex) {
+        std::mt19937 random(threadIndex + 1);
+        vector<ShardedMemoryManager::Handle> live;
+        live.reserve(maxLiveAllocations);
+        MpscQueue<ShardedMemoryManager::Handle>& nextInbox =
+            *inboxes[(threadIndex + 1) % threadsCount];
+
+        for (size_t operation = 0; operation < operationsPerThread; ++operation) {
+            ShardedMemoryManager::Handle handle;
+            while (inboxes[threadIndex]->pop(handle)) {
+                memoryManager.revoke(handle);
+            }
+
+            if (live.size() < maxLiveAllocations && (live.empty() || random() % 2 == 0)) {
+                ShardedMemoryManager::Allocation allocation =
+                    memoryManager.allocate(threadIndex, 1 + random() % 64);
+                if (allocation.offset != FAIL_CODE) {
+                    live.push_back(allocation.handle);
+                }
+            } else {
+                size_t position = random() % live.size();
+                handle = live[position];
+                live[position] = live.back();
+                live.pop_back();
+                if (random() % 4 != 0 || !nextInbox.push(handle)) {
+                    memoryManager.revoke(handle);
+                }
+            }
+        }
+    };
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    vector<std::thread> threads;
+    for (size_t thread = 0; thread < threadsCount; ++thread) {
+        threads.emplace_back(work, thread);
+    }
+    for (size_t thread = 0; thread < threadsCount; ++thread) {
+        threads[thread].join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return threadsCount * operationsPerThread / elapsed.count();
+}
+
+// Prints the throughput of `ShardedMemoryManager` for 1..maxThreadsCount threads.
+void BenchmarkShardedMemoryManagerAll(size_t maxThreadsCount) {
+    const size_t operationsPerThread = 2000000;
+    double singleThreadThroughput = 0;
+    cout << "threads\toperations/s\tspeedup" << endl;
+    for (size_t threadsCount = 1; threadsCount <= maxThreadsCount; ++threadsCount) {
+        double throughput = BenchmarkShardedMemoryManager(threadsCount, operationsPerThread);
+        if (threadsCount == 1) {
+            singleThreadThroughput = throughput;
+        }
+        cout << threadsCount << '\t' << std::fixed << std::setprecision(0) << throughput
+             << '\t' << std::setprecision(2) << throughput / singleThreadThroughput << endl;
+    }
+}
+
+// Measures a batch of `releasesCount` revocations in `MemoryManager` with
+// `freePartsCount` free parts between occupied ones, so every revocation
+// merges the part with two free neighbours. Returns the time in seconds.
+double BenchmarkBulkRelease(int freePartsCount, int releasesCount, int bulkReleaseRatio) {
+    std::mt19937 random(1);
+    vector<int> rawRequests;
+    int memorySize = 0;
+    for (int i = 0; i < 2 * freePartsCount; ++i) {
+        rawRequests.push_back(1 + random() % 1000);
+        memorySize += rawRequests.back();
+    }
+    for (int i = 1; i <= 2 * freePartsCount; i += 2) {
+        rawRequests.push_back(-i);
+    }
+
+    vector<int> releases;
+    for (int i = 2; i <= 2 * freePartsCount; i += 2) {
+        releases.push_back(-i);
+    }
+    std::shuffle(releases.begin(), releases.end(), random);
+    releases.resize(releasesCount);
+
+    MemoryManagerOptions options;
+    options.bulkReleaseRatio = bulkReleaseRatio;
+    MemoryManager<> memoryManager(memorySize, options);
+    vector<MemorySize> results(rawRequests.size());
+    memoryManager.process(rawRequests.data(), rawRequests.size(), results.data());
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    memoryManager.process(releases.data(), releases.size(), results.data());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// Prints the times of the incremental and the bulk release batches
+// of growing sizes to find where the bulk rebuild starts to win.
+void BenchmarkBulkReleaseAll(int freePartsCount) {
+    const int repeats = 5;
+    cout << "releases\tincremental, ms\tbulk, ms" << endl;
+    for (int divisor = 1024; divisor >= 1; divisor /= 2) {
+        int releasesCount = std::max(freePartsCount / divisor, 1);
+        double incremental = 0;
+        double bulk = 0;
+        for (int repeat = 0; repeat < repeats; ++repeat) {
+            incremental += BenchmarkBulkRelease(freePartsCount, releasesCount, 0);
+            bulk += BenchmarkBulkRelease(freePartsCount, releasesCount, freePartsCount);
+        }
+        cout << releasesCount << '\t' << std::fixed << std::setprecision(3)
+             << 1000 * incremental / repeats << '\t' << 1000 * bulk / repeats << endl;
+    }
+}
+
+// Measures random allocations and deallocations of 8..512 bytes through
+// the resource, with up to 4096 live blocks. Returns nanoseconds per operation.
+double BenchmarkMemoryResource(std::pmr::memory_resource& resource, size_t operationsCount) {
+    const size_t maxLiveBlocks = 4096;
+    std::mt19937 random(1);
+    vector<pair<void*, size_t>> live;
+    live.reserve(maxLiveBlocks);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t operation = 0; operation < operationsCount; ++operation) {
+        if (live.size() < maxLiveBlocks && (live.empty() || random() % 2 == 0)) {
+            size_t size = 8 + random() % 505;
+            live.push_back(std::make_pair(resource.allocate(size), size));
+        } else {
+            size_t position = random() % live.size();
+            resource.deallocate(live[position].first, live[position].second);
+            live[position] = live.back();
+            live.pop_back();
+        }
+    }
+    for (size_t i = 0; i < live.size(); ++i) {
+        resource.deallocate(live[i].first, live[i].second);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / operationsCount;
+}
+
+// Measures random insertions and erasures in a `std::pmr::map`
+// of up to 4096 keys. Returns nanoseconds per operation.
+double BenchmarkMemoryResourceMap(std::pmr::memory_resource& resource, size_t operationsCount) {
+    std::mt19937 random(1);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+        std::pmr::map<int, int> map(&resource);
+        for (size_t operation = 0; operation < operationsCount; ++operation) {
+            int key = random() % 8192;
+            if (!map.erase(key)) {
+                map.emplace(key, operation);
+            }
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / operationsCount;
+}
+
+// Prints the times of the workloads with `BufferMemoryResource` and the
+// standard resources. The monotonic resource never reuses memory.
+void BenchmarkMemoryResourcesAll() {
+    const size_t operationsCount = 2000000;
+    const size_t bufferSize = 64 << 20;
+    cout << "resource\tblocks, ns/op\tpmr::map, ns/op" << endl;
+
+    auto report = [&](const string& name, auto makeResource) {
+        double blocks;
+        double map;
+        {
+            auto resource = makeResource();
+            blocks = BenchmarkMemoryResource(*resource, operationsCount);
+        }
+        {
+            auto resource = makeResource();
+            map = BenchmarkMemoryResourceMap(*resource, operationsCount);
+        }
+        cout << name << '\t' << std::fixed << std::setprecision(1) << blocks << '\t' << map << endl;
+    };
+
+    report("BufferMemoryResource", [&] {
+        return std::unique_ptr<std::pmr::memory_resource>(new BufferMemoryResource<>(bufferSize));
+    });
+    report("BufferMemoryResource, size classes", [&] {
+        MemoryManagerOptions options;
+        options.sizeClasses = PowerOfTwoSizeClasses(64);
+        return std::unique_ptr<std::pmr::memory_resource>(
+            new BufferMemoryResource<>(bufferSize, options));
+    });
+    report("new_delete_resource", [&] {
+        return std::unique_ptr<std::pmr::memory_resource, void(*)(std::pmr::memory_resource*)>(
+            std::pmr::new_delete_resource(), [](std::pmr::memory_resource*) {});
+    });
+    report("monotonic_buffer_resource", [&] {
+        return std::unique_ptr<std::pmr::memory_resource>(
+            new std::pmr::monotonic_buffer_resource(bufferSize));
+    });
+    report("unsynchronized_pool_resource", [&] {
+        return std::unique_ptr<std::pmr::memory_resource>(
+            new std::pmr::unsynchronized_pool_resource());
+    });
+}
+
+// Synthetic workload of the benchmark suite: the sizes of the
+// allocations and the order in which the live allocations are revoked.
+struct Workload {
+    enum Sizes {
+        // 1..MAX_SIZE cells.
+        UNIFORM_SIZES,
+        // Pareto distributed, most allocations are a few cells.
+        POWER_LAW_SIZES
+    };
+    enum Order {
+        // The newest live allocation.
+        LIFO,
+        // The oldest live allocation.
+        FIFO,
+        RANDOM,
+        // One in 16 allocations is long-lived and revoked only when they
+        // fill half of the live allocations, the rest are revoked randomly.
+        MIXED_LIFETIMES
+    };
+
+    static constexpr int MAX_SIZE = 256;
+    static constexpr size_t MAX_LIVE_ALLOCATIONS = 4096;
+    // Twice the cells of the live allocations of the mean uniform size.
+    static constexpr int MEMORY_SIZE = MAX_LIVE_ALLOCATIONS * MAX_SIZE;
+
+    string name;
+    Sizes sizes;
+    Order order;
+};
+
+// Generates the requests of a workload in chunks: an allocation if there
+// are fewer than `MAX_LIVE_ALLOCATIONS` live ones and a coin says so,
+// else a revocation. The request numbers count every request.
+class WorkloadGenerator {
+public:
+    explicit WorkloadGenerator(const Workload& workload)
+        : workload_(workload),
+          random_(1),
+          requestsCount_(0),
+          longLivedCount_(0),
+          peakLiveCount_(0),
+          allocationsCount_(0)
+    {}
+
+    // Replaces `rawRequests` by the next `count` requests.
+    void generate(size_t count, vector<int>& rawRequests) {
+        rawRequests.clear();
+        for (size_t i = 0; i < count; ++i) {
+            ++requestsCount_;
+            if (live_.size() < Workload::MAX_LIVE_ALLOCATIONS &&
+                (live_.empty() || random_() % 2 == 0)) {
+                rawRequests.push_back(nextSize());
+                bool longLived = workload_.order == Workload::MIXED_LIFETIMES && random_() % 16 == 0;
+                live_.push_back(std::make_pair(requestsCount_, longLived));
+                longLivedCount_ += longLived;
+                peakLiveCount_ = std::max(peakLiveCount_, live_.size());
+                ++allocationsCount_;
+            } else {
+                rawRequests.push_back(-takeRevoked());
+            }
+        }
+    }
+
+    size_t peakLiveCount() const {
+        return peakLiveCount_;
+    }
+
+    uint64_t allocationsCount() const {
+        return allocationsCount_;
+    }
+
+private:
+    int nextSize() {
+        if (workload_.sizes == Workload::UNIFORM_SIZES) {
+            return 1 + random_() % Workload::MAX_SIZE;
+        }
+        double uniform = std::uniform_real_distribution<double>(0, 1)(random_);
+        return std::min<double>(std::pow(1 - uniform, -1 / 1.2), Workload::MAX_SIZE);
+    }
+
+    // Removes the allocation to revoke from the live ones, returns its number.
+    unsigned int takeRevoked() {
+        size_t position = 0;
+        switch (workload_.order) {
+        case Workload::LIFO:
+            position = live_.size() - 1;
+            break;
+        case Workload::FIFO:
+            position = 0;
+            break;
+        case Workload::RANDOM:
+            position = random_() % live_.size();
+            break;
+        case Workload::MIXED_LIFETIMES:
+            position = random_() % live_.size();
+            // Picks a short-lived one unless the long-lived fill half.
+            while (live_[position].second && 2 * longLivedCount_ < live_.size()) {
+                position = random_() % live_.size();
+            }
+            break;
+        }
+
+        pair<unsigned int, bool> revoked = live_[position];
+        if (workload_.order == Workload::FIFO) {
+            live_.pop_front();
+        } else {
+            live_[position] = live_.back();
+            live_.pop_back();
+        }
+        longLivedCount_ -= revoked.second;
+        return revoked.first;
+    }
+
+    Workload workload_;
+    std::mt19937 random_;
+    unsigned int requestsCount_;
+    // The numbers of the live allocations and whether they are long-lived.
+    // The order is kept for LIFO and FIFO, which only take the ends.
+    std::deque<pair<unsigned int, bool>> live_;
+    size_t longLivedCount_;
+    size_t peakLiveCount_;
+    uint64_t allocationsCount_;
+};
+
+template <class Placement>
+double FragmentationOf(const MemoryManager<Placement>& memoryManager) {
+    return memoryManager.stats().fragmentation;
+}
+
+// The buddy engine has no statistics.
+double FragmentationOf(const BuddyMemoryManager& /* memoryManager */) {
+    return -1;
+}
+
+// Runs the workloads at 10^3, 10^4, ... up to `maxOperationsCount`
+// operations with the memory manager chosen by `settings` and `Heap`
+// insertions and pops, and prints the results as JSON. Only `process`
+// and the heap operations are timed, the requests are generated between.
+void BenchmarkSuite(const EngineSettings& settings, uint64_t maxOperationsCount) {
+    const size_t chunkSize = 1 << 16;
+    const vector<Workload> workloads{
+        {"uniform-lifo", Workload::UNIFORM_SIZES, Workload::LIFO},
+        {"uniform-fifo", Workload::UNIFORM_SIZES, Workload::FIFO},
+        {"uniform-random", Workload::UNIFORM_SIZES, Workload::RANDOM},
+        {"uniform-mixed-lifetimes", Workload::UNIFORM_SIZES, Workload::MIXED_LIFETIMES},
+        {"power-law-lifo", Workload::POWER_LAW_SIZES, Workload::LIFO},
+        {"power-law-fifo", Workload::POWER_LAW_SIZES, Workload::FIFO},
+        {"power-law-random", Workload::POWER_LAW_SIZES, Workload::RANDOM},
+        {"power-law-mixed-lifetimes", Workload::POWER_LAW_SIZES, Workload::MIXED_LIFETIMES},
+    };
+
+    const string managerName = settings.engine == "buddy" ? "BuddyMemoryManager" : "MemoryManager";
+    cout << "{\"engine\": \"" << settings.engine << "\", \"placement\": \""
+         << (settings.engine == "buddy" ? "buddy" : settings.placement) << "\", \"results\": [";
+    const char* separator = "\n";
+    for (uint64_t operationsCount = 1000; operationsCount <= maxOperationsCount;
+         operationsCount *= 10) {
+        for (size_t w = 0; w < workloads.size(); ++w) {
+            RunWithMemoryManager(settings, Workload::MEMORY_SIZE, [&](auto& memoryManager) {
+                WorkloadGenerator generator(workloads[w]);
+                vector<int> rawRequests;
+                vector<MemorySize> results(chunkSize);
+                uint64_t failedCount = 0;
+                std::chrono::nanoseconds elapsed(0);
+                for (uint64_t done = 0; done < operationsCount; done += rawRequests.size()) {
+                    generator.generate(std::min<uint64_t>(chunkSize, operationsCount - done),
+                                       rawRequests);
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    size_t resultsCount = memoryManager.process(rawRequests.data(),
+                                                                rawRequests.size(), results.data());
+                    elapsed += std::chrono::steady_clock::now() - start;
+                    failedCount += std::count(results.begin(), results.begin() + resultsCount,
+                                              FAIL_CODE);
+                }
+
+                double seconds = std::chrono::duration<double>(elapsed).count();
+                double fragmentation = FragmentationOf(memoryManager);
+                cout << separator << std::fixed
+                     << "  {\"benchmark\": \"" << managerName << "\", \"workload\": \"" << workloads[w].name
+                     << "\", \"operations\": " << operationsCount
+                     << ", \"ns_per_op\": " << std::setprecision(1) << 1e9 * seconds / operationsCount
+                     << ", \"allocations_per_second\": ";
+                // A short run may take less than the resolution of the clock.
+                if (seconds > 0) {
+                    cout << std::setprecision(0) << generator.allocationsCount() / seconds;
+                } else {
+                    cout << "null";
+                }
+                cout << ", \"peak_blocks\": " << generator.peakLiveCount()
+                     << ", \"failed_allocations\": " << failedCount << ", \"fragmentation\": ";
+                if (fragmentation < 0) {
+                    cout << "null}";
+                } else {
+                    cout << std::setprecision(4) << fragmentation << "}";
+                }
+                separator = ",\n";
+            });
+        }
+
+        // A push and a pop of a heap of up to `MAX_LIVE_ALLOCATIONS` elements.
+        std::mt19937 random(1);
+        Heap<int> heap;
+        std::chrono::nanoseconds elapsed(0);
+        vector<int> values(chunkSize);
+        for (uint64_t done = 0; done < operationsCount; done += values.size()) {
+            values.resize(std::min<uint64_t>(chunkSize, operationsCount - done));
+            for (size_t i = 0; i < values.size(); ++i) {
+                values[i] = random();
+            }
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < values.size(); ++i) {
+                if (heap.size() < Workload::MAX_LIVE_ALLOCATIONS && values[i] % 2 == 0) {
+                    heap.insert(values[i]);
+                } else if (!heap.empty()) {
+                    heap.pop();
+                }
+            }
+            elapsed += std::chrono::steady_clock::now() - start;
+        }
+        cout << separator << "  {\"benchmark\": \"Heap\", \"workload\": \"random-push-pop\""
+             << ", \"operations\": " << operationsCount << ", \"ns_per_op\": " << std::fixed
+             << std::setprecision(1)
+             << std::chrono::duration<double, std::nano>(elapsed).count() / operationsCount << "}";
+    }
+    cout << "\n]}" << endl;
+}
+
+// Returns the value not less than the `fraction` of `values`.
+uint32_t Percentile(vector<uint32_t>& values, double fraction) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t position = std::min(values.size() - 1, size_t(fraction * values.size()));
+    std::nth_element(values.begin(), values.begin() + position, values.end());
+    return values[position];
+}
+
+void PrintLatencies(const string& name, vector<uint32_t>& latencies) {
+    cout << name << ", ns: p50 " << Percentile(latencies, 0.5)
+         << ", p90 " << Percentile(latencies, 0.9)
+         << ", p99 " << Percentile(latencies, 0.99)
+         << ", p99.9 " << Percentile(latencies, 0.999)
+         << ", max " << Percentile(latencies, 1) << endl;
+}
+
+template <class Placement>
+void PrintFragmentation(const MemoryManager<Placement>& memoryManager) {
+    MemoryManagerStats stats = memoryManager.stats();
+    cout << "fragmentation: " << stats.fragmentation << " (" << stats.freePartsCount
+         << " free parts, the largest of " << stats.largestFreePart << " cells)" << endl;
+}
+
+void PrintFragmentation(const BuddyMemoryManager& /* memoryManager */) {
+    cout << "fragmentation: unknown for the buddy engine" << endl;
+}
+
+// Replays the trace from the file twice: in batches through `process`
+// to measure the throughput, then request by request to measure the
+// latencies, which costs two clock reads per request.
+// Returns `false` if the trace can't be read.
+bool ReplayTrace(const EngineSettings& settings, const string& path) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    MappedFile file(path);
+    Trace trace;
+    if (!file.valid() || !ReadTrace(file, trace)) {
+        cerr << "can't read the trace from " << path << endl;
+        return false;
+    }
+    std::chrono::duration<double> readingTime = std::chrono::steady_clock::now() - start;
+
+    std::chrono::duration<double> processingTime;
+    RunWithMemoryManager(settings, trace.memorySize, [&](auto& memoryManager) {
+        vector<MemorySize> results(REQUESTS_BATCH_SIZE);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t begin = 0; begin < trace.count; ) {
+            size_t end = RawRequestsBatchEnd(trace.requests, begin, trace.count);
+            memoryManager.process(trace.requests + begin, end - begin, results.data());
+            begin = end;
+        }
+        processingTime = std::chrono::steady_clock::now() - start;
+    });
+
+    size_t requestsCount = 0;
+    for (size_t i = 0; i < trace.count; i += RawRequestLength(trace.requests[i])) {
+        ++requestsCount;
+    }
+    cout << "requests: " << requestsCount << endl
+         << "reading, ms: " << 1000 * readingTime.count() << endl
+         << "throughput, requests/s: " << uint64_t(requestsCount / processingTime.count()) << endl;
+
+    RunWithMemoryManager(settings, trace.memorySize, [&](auto& memoryManager) {
+        vector<uint32_t> allocationLatencies;
+        vector<uint32_t> revocationLatencies;
+        vector<uint32_t> reallocationLatencies;
+        for (size_t i = 0; i < trace.count; i += RawRequestLength(trace.requests[i])) {
+            const int* rawRequest = trace.requests + i;
+            if (rawRequest[0] == REALLOCATION_CODE && i + REALLOCATION_LENGTH > trace.count) {
+                break;
+            }
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if (rawRequest[0] >= 0) {
+                memoryManager.allocate(rawRequest[0]);
+            } else if (rawRequest[0] != REALLOCATION_CODE) {
+                memoryManager.revoke(-rawRequest[0]);
+            } else {
+                memoryManager.reallocate(rawRequest[1], rawRequest[2]);
+            }
+            std::chrono::nanoseconds latency = std::chrono::steady_clock::now() - start;
+            (rawRequest[0] >= 0 ? allocationLatencies :
+             rawRequest[0] != REALLOCATION_CODE ? revocationLatencies : reallocationLatencies)
+                .push_back(latency.count());
+        }
+
+        PrintLatencies("allocate", allocationLatencies);
+        PrintLatencies("revoke", revocationLatencies);
+        if (!reallocationLatencies.empty()) {
+            PrintLatencies("reallocate", reallocationLatencies);
+        }
+        PrintFragmentation(memoryManager);
+    });
+    return true;
+}
+
+// Converts the trace to the binary format.
+// Returns `false` if it can't be read or written.
+bool ConvertTrace(const string& textPath, const string& binaryPath) {
+    MappedFile textFile(textPath);
+    Trace trace;
+    if (!textFile.valid() || !ReadTrace(textFile, trace)) {
+        cerr << "can't read the trace from " << textPath << endl;
+        return false;
+    }
+
+    FILE* binaryFile = std::fopen(binaryPath.c_str(), "wb");
+    bool written = binaryFile != nullptr && WriteBinaryTrace(trace, binaryFile);
+    written = binaryFile != nullptr && std::fclose(binaryFile) == 0 && written;
+    if (!written) {
+        cerr << "can't write the trace to " << binaryPath << endl;
+    }
+    return written;
+}
+
+// Parses a positive `int` taking the whole of `text`.
+// Returns `false` if there is anything else.
+bool ParsePositiveInt(const string& text, int& value) {
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) {
+        return false;
+    }
+    errno = 0;
+    char* end;
+    long parsed = std::strtol(text.c_str(), &end, 10);
+    if (errno == ERANGE || *end != '\0' || parsed <= 0 ||
+        parsed > std::numeric_limits<int>::max()) {
+        return false;
+    }
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+// Parses the size classes given as "pow2:<max size>" or as comma
+// separated positive sizes to `sizeClasses`, sorted and without repeats.
+// Returns `false` if the description is malformed.
+bool ParseSizeClasses(const string& description, vector<int>& sizeClasses) {
+    sizeClasses.clear();
+    const string powerOfTwoPrefix = "pow2:";
+    if (description.compare(0, powerOfTwoPrefix.size(), powerOfTwoPrefix) == 0) {
+        int maxSize;
+        if (!ParsePositiveInt(description.substr(powerOfTwoPrefix.size()), maxSize)) {
+            return false;
+        }
+        sizeClasses = PowerOfTwoSizeClasses(maxSize);
+        return true;
+    }
+
+    size_t begin = 0;
+    while (begin <= description.size()) {
+        size_t end = description.find(',', begin);
+        if (end == string::npos) {
+            end = description.size();
+        }
+        int size;
+        if (!ParsePositiveInt(description.substr(begin, end - begin), size)) {
+            return false;
+        }
+        sizeClasses.push_back(size);
+        begin = end + 1;
+    }
+    std::sort(sizeClasses.begin(), sizeClasses.end());
+    sizeClasses.erase(std::unique(sizeClasses.begin(), sizeClasses.end()), sizeClasses.end());
+    return true;
+}
+
+void PrintUsage(const char* program) {
+    cerr << "Usage: " << program
+         << " [--test [--test-seed <seed>] [--test-threads <count>] [--test-iterations <count>]]"
+         << " [--engine heap|buddy]"
+         << " [--placement worst-fit|best-fit|first-fit|next-fit]"
+         << " [--size-classes pow2:<max size>|<size>,<size>,...]"
+         << " [--pending-limit <count>]"
+         << " [--buddy-min-order <order>]"
+         << " [--pipeline]"
+         << " [--stats]"
+         << " [--load-snapshot <file>] [--save-snapshot <file>]"
+         << " [--replay <trace>] [--convert-trace <text trace> <binary trace>]"
+         << " [--benchmark-sharded <max threads>]"
+         << " [--benchmark-suite <max operations>]"
+         << " [--benchmark-bulk-release <free parts>]"
+         << " [--benchmark-memory-resource]" << endl;
+}
+
+int main(int argc, char *argv[]) {  
+    EngineSettings settings;
+    bool pipeline = false;
+    bool stats = false;
+    string loadedSnapshot;
+    string savedSnapshot;
+    string replayedTrace;
+    uint64_t benchmarkSuiteOperations = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        string argument = argv[i];
+        if (argument == "--test") {
+            if (!ParseTestArguments(argc, argv, i + 1)) {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+            TestAll();
+            return 0;
+        } else if (argument == "--engine" && i + 1 < argc) {
+            settings.engine = argv[++i];
+        } else if (argument == "--placement" && i + 1 < argc) {
+            settings.placement = argv[++i];
+        } else if (argument == "--size-classes" && i + 1 < argc) {
+            if (!ParseSizeClasses(argv[++i], settings.options.sizeClasses)) {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        } else if (argument == "--pending-limit" && i + 1 < argc) {
+            settings.options.pendingLimit = std::atoi(argv[++i]);
+        } else if (argument == "--buddy-min-order" && i + 1 < argc) {
+            settings.buddyMinOrder = std::atoi(argv[++i]);
+        } else if (argument == "--pipeline") {
+            pipeline = true;
+        } else if (argument == "--stats") {
+            stats = true;
+        } else if (argument == "--load-snapshot" && i + 1 < argc) {
+            loadedSnapshot = argv[++i];
+        } else if (argument == "--save-snapshot" && i + 1 < argc) {
+            savedSnapshot = argv[++i];
+        } else if (argument == "--replay" && i + 1 < argc) {
+            replayedTrace = argv[++i];
+        } else if (argument == "--benchmark-suite" && i + 1 < argc) {
+            benchmarkSuiteOperations = std::strtoull(argv[++i], nullptr, 10);
+        } else if (argument == "--convert-trace" && i + 2 < argc) {
+            string textPath = argv[++i];
+            string binaryPath = argv[++i];
+            return ConvertTrace(textPath, binaryPath) ? 0 : 1;
+        } else if (argument == "--benchmark-memory-resource") {
+            BenchmarkMemoryResourcesAll();
+            return 0;
+        } else if (argument == "--benchmark-bulk-release" && i + 1 < argc) {
+            BenchmarkBulkReleaseAll(std::atoi(argv[++i]));
+            return 0;
+        } else if (argument == "--benchmark-sharded" && i + 1 < argc) {
+            BenchmarkShardedMemoryManagerAll(std::atoi(argv[++i]));
+            return 0;
+        } else {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (!settings.valid()) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (!replayedTrace.empty()) {
+        return ReplayTrace(settings, replayedTrace) ? 0 : 1;
+    }
+    if (benchmarkSuiteOperations > 0) {
+        BenchmarkSuite(settings, benchmarkSuiteOperations);
+        return 0;
+    }
+
+    InputReader input(stdin);
+    OutputWriter output(stdout);
+    MemorySize memorySize = 0;
+    int requestNumber = 0;
+    if (!input.readInt(memorySize) || memorySize < 0 || memorySize > MAX_MEMORY_SIZE ||
+        !input.readInt(requestNumber) || requestNumber < 0) {
+        cerr << "can't read the memory size and the number of requests" << endl;
+        return 1;
+    }
+    bool failed = false;
+    RunWithMemoryManager(settings, memorySize, [&](auto& memoryManager) {
+        if (!loadedSnapshot.empty() && !LoadSnapshot(memoryManager, loadedSnapshot)) {
+            failed = true;
+            return;
+        }
+        if (pipeline) {
+            ProcessRequestsPipelined(memoryManager, requestNumber, input, output);
+        } else {
+            ProcessRequests(memoryManager, requestNumber, input, output);
+        }
+        if (stats) {
+            output.flush();
+            PrintManagerStats(memoryManager);
+        }
+        if (!savedSnapshot.empty() && !SaveSnapshot(memoryManager, savedSnapshot)) {
+            failed = true;
+        }
+    });
+    return failed ? 1 : 0;
+}
+
+//############################Testing################################
+
+template<typename T, typename U>
+ostream& operator << (ostream& stream, const pair<T, U>& value) {
+    return stream << "(" << value.first << "," << value.second << ")";
+}
+
+template<typename T>
+ostream& operator << (ostream& stream, const vector<T>& vec) {
+    stream << "{";
+    for (size_t i = 0; i < vec.size(); ++i) {
+        stream << vec[i];
+        if (i + 1 < vec.size()) {
+            stream << ",";
+        }
+    }
+    return stream << "}";
+}
+
+// Compares calculated value `result` with the right value `expected`.
+// If result differ from expected, throws RuntimeError
+template<typename T, typename U, typename V>
+void CheckResult(T input, U result, V expected, string functionName) {
+    if (!(result == expected)) {
+        cerr << "While testing " << functionName << ". "
+             << "For input "     << input
+             << " expected "     << expected
+             << " but got "      << result       << endl;
+        throw runtime_error("Test failed");
+    }
+}
+        
+template <int Arity>
+void CheckHeap(const vector<int>& input,
+               const Heap<int, greater<int>, IgnorePositions<int>, Arity>& heap,
+               string methodName) {
+    // The first position whose parent is smaller, zero if the heap is correct.
+    const std::pmr::vector<int>& elements = heap.elements_;
+    int wrongPosition = 0;
+    for (int i = 1; i < int(elements.size()) && wrongPosition == 0; ++i) {
+        if (elements[(i - 1) / Arity] < elements[i]) {
+            wrongPosition = i;
+        }
+    }
+    CheckResult(input, wrongPosition, 0,
+                methodName + " of the " + std::to_string(Arity) + "-ary Heap");
+}
+
+vector<int> RandomVector(int maxLength, int maxItemAbs) {
+    vector<int> randomVector(Random(1, maxLength));
+    for (size_t i = 0; i < randomVector.size(); ++i) {
+        randomVector[i] = Random(-maxItemAbs, maxItemAbs);
+    }
+    return randomVector;
+}
+
+template <int Arity>
+void TestHeapConstructor(const vector<int>& input) {
+    Heap<int, greater<int>, IgnorePositions<int>, Arity> heap(input);
+    CheckHeap(input, heap, "single parameter constructor");
+}
+
+template <int Arity>
+void StressTestConstructor(int maxLength, int maxItemAbs) {
+    vector<int> input = RandomVector(maxLength, maxItemAbs);
+    TestHeapConstructor<Arity>(input);
+}
+
+template <int Arity>
+void TestHeapConstructorAll() {
+    TestHeapConstructor<Arity>(vector<int>{1, 2, 3, 4, 5});
+    TestHeapConstructor<Arity>(vector<int>{5, 4, 3, 2, 1});
+    TestHeapConstructor<Arity>(vector<int>{3, 5, 2, 1, 4});
+    TestHeapConstructor<Arity>(vector<int>{5, 5, 5, 5, 5});
+    TestHeapConstructor<Arity>(vector<int>{10});
+
+    const size_t smallTestCount = 1000;
+    RunStressTest("StressTestConstructor", 07012014, smallTestCount, [&] {
+        StressTestConstructor<Arity>(10, 10);
+    });
+
+    const size_t bigTestCount = 1000;
+    RunStressTest("StressTestConstructor", 07012014, bigTestCount - smallTestCount, [&] {
+        StressTestConstructor<Arity>(100, 1000);
+    });
+}
+
+template <int Arity>
+void TestHeapInsert(const vector<int>& currentHeap, int newElement) {
+    Heap<int, greater<int>, IgnorePositions<int>, Arity> heap(currentHeap);
+    heap.insert(newElement);
+    CheckHeap(currentHeap, heap, "insert");
+}
+
+template <int Arity>
+void StressTestInsert(int maxLength, int maxItemAbs, int maxInsertionsCount) {
+    vector<int> input = RandomVector(maxLength, maxItemAbs);
+
+    int insertionsCount = Random(0, maxInsertionsCount);
+    for (int testNum = 1; testNum <= insertionsCount; ++testNum) {
+        int newElement = Random(-maxItemAbs, maxItemAbs);
+        TestHeapInsert<Arity>(input, newElement);
+    }
+}
+
+template <int Arity>
+void TestHeapInsertAll() {
+    TestHeapInsert<Arity>(vector<int>{1, 2, 3, 4, 5}, 6);
+    TestHeapInsert<Arity>(vector<int>{5, 4, 3, 2, 1}, 0);
+    TestHeapInsert<Arity>(vector<int>{3, 8, 2, 1, 4}, 5);
+    TestHeapInsert<Arity>(vector<int>{5, 5, 5, 5, 5}, 5);
+
+    const size_t smallTestCount = 1000;
+    RunStressTest("StressTestInsert", 07012014, smallTestCount, [&] {
+        StressTestInsert<Arity>(10, 10, 1);
+    });
+
+    const size_t bigTestCount = 1000;
+    RunStressTest("StressTestInsert", 07012014, bigTestCount - smallTestCount, [&] {
+        StressTestInsert<Arity>(100, 1000, 10);
+    });
+}
+
+template <int Arity>
+void TestHeapRemove(const vector<int>& currentHeap, int positionForRemove) {
+    Heap<int, greater<int>, IgnorePositions<int>, Arity> heap(currentHeap);
+    heap.remove(positionForRemove);
+    CheckHeap(currentHeap, heap, "remove");
+}
+
+template <int Arity>
+void StressTestRemove(int maxLength, int maxItemAbs, int maxRemovalCount) {
+    vector<int> input = RandomVector(maxLength, maxItemAbs);
+
+    int insertionsCount = Random(0, maxRemovalCount);
+    for (int testNum = 1; testNum <= insertionsCount; ++testNum) {
+        int position = Random(0, maxItemAbs);
+        TestHeapRemove<Arity>(input, position);
+    }
+}
+
+template <int Arity>
+void TestHeapRemoveAll() {
+    TestHeapRemove<Arity>(vector<int>{1, 2, 3, 4, 5}, 3);
+    TestHeapRemove<Arity>(vector<int>{1, 2, 3, 4, 5}, -3);
+    TestHeapRemove<Arity>(vector<int>{1, 2, 3, 4, 5}, 10);
+    TestHeapRemove<Arity>(vector<int>{3, 8, 2, 1, 4}, 1);
+    TestHeapRemove<Arity>(vector<int>{5, 5, 5, 5, 5}, 2);
+
+    const size_t smallTestCount = 1000;
+    RunStressTest("StressTestRemove", 07012014, smallTestCount, [&] {
+        StressTestRemove<Arity>(10, 10, 1);
+    });
+
+    const size_t bigTestCount = 1000;
+    RunStressTest("StressTestRemove", 07012014, bigTestCount - smallTestCount, [&] {
+        StressTestRemove<Arity>(100, 1000, 10);
+    });
+}
+
+struct KeyedElement {
+    int key;
+    int position;
+};
+
+class CompareKeyedElements {
+public:
+    bool operator() (const KeyedElement* left, const KeyedElement* right) const {
+        return left->key > right->key;
+    }
+};
+
+class KeyedElementPositions {
+public:
+    int get(const KeyedElement* element) const {
+        return element->position;
+    }
+
+    void set(KeyedElement* element, int position) const {
+        element->position = position;
+    }
+};
+
+// Changes the keys of random elements in place and erases random elements,
+// sometimes with the order suspended, then checks that the heap pops the
+// rest in order.
+template <int Arity>
+void StressTestHeapUpdate(int maxLength, int maxItemAbs) {
+    vector<int> keys = RandomVector(maxLength, maxItemAbs);
+    vector<KeyedElement> elements(keys.size());
+    vector<KeyedElement*> pointers;
+    for (size_t i = 0; i < elements.size(); ++i) {
+        elements[i].key = keys[i];
+        pointers.push_back(&elements[i]);
+    }
+    Heap<KeyedElement*, CompareKeyedElements, KeyedElementPositions, Arity> heap(pointers);
+
+    if (Random(0, 1) == 1) {
+        heap.suspendOrder();
+    }
+    int operationsCount = Random(0, 2 * maxLength);
+    for (int operation = 0; operation < operationsCount; ++operation) {
+        KeyedElement& element = elements[Random(0, elements.size() - 1)];
+        if (element.position == OUT_OF_HEAP) {
+            continue;
+        }
+        if (Random(0, 3) == 0) {
+            heap.erase(&element);
+        } else {
+            element.key = Random(-maxItemAbs, maxItemAbs);
+            heap.update(&element);
+        }
+    }
+
+    heap.restoreOrder();
+
+    vector<int> expected;
+    for (size_t i = 0; i < elements.size(); ++i) {
+        if (elements[i].position != OUT_OF_HEAP) {
+            expected.push_back(elements[i].key);
+        }
+    }
+    std::sort(expected.begin(), expected.end(), greater<int>());
+
+    vector<int> result;
+    while (!heap.empty()) {
+        result.push_back(heap.top()->key);
+        heap.pop();
+    }
+    CheckResult(keys, result, expected, "update and erase of the Heap");
+}
+
+template <int Arity>
+void TestHeapUpdateAll() {
+    const size_t testCount = 1000;
+    RunStressTest("StressTestHeapUpdate", 07012014, testCount, [&] {
+        StressTestHeapUpdate<Arity>(100, 1000);
+    });
+}
+
+template <int Arity>
+void TestHeapArity() {
+    string heap = " of the " + std::to_string(Arity) + "-ary Heap";
+    RunTestSuite("single parameter constructor" + heap, TestHeapConstructorAll<Arity>);
+    RunTestSuite("insert" + heap, TestHeapInsertAll<Arity>);
+    RunTestSuite("remove" + heap, TestHeapRemoveAll<Arity>);
+    RunTestSuite("update and erase" + heap, TestHeapUpdateAll<Arity>);
+}
+
+void TestHeapAll() {
+    TestHeapArity<2>();
+    TestHeapArity<3>();
+    TestHeapArity<FREE_PARTS_HEAP_ARITY>();
+    TestHeapArity<8>();
+}
+
+template <class Placement = WorstFitPlacement>
+void TestMemoryManage(int size, const vector<int>& rawRequests, const vector<int>& answers,
+                      const MemoryManagerOptions& options = MemoryManagerOptions()) {
+    MemoryManager<Placement> manager(size, options);
+    vector<int> results;
+    results.reserve(rawRequests.size());
+
+    for (size_t i = 0; i < rawRequests.size(); i += RawRequestLength(rawRequests[i])) {
+        RawRequest request = DecodeRequest(&rawRequests[i]);
+        int result = processRequest(manager, request);
+        if (request.type != REVOCATION) {
+            results.push_back(result);
+        }
+    }
+
+    CheckResult(rawRequests, results, answers, "processRequest");
+}
+
+// Processes the requests by the definition: memory is an array of cells,
+// an allocation takes the beginning of a run of free cells chosen
+// by the `placement` rule. A reallocation takes or frees the cells after
+// the run of its request if it can, else moves like an allocation.
+// Stores the final owners of the cells to `finalOwners` if it is given.
+vector<int> ReferenceMemoryManage(int size, const vector<int>& rawRequests,
+                                  const string& placement = "worst-fit",
+                                  vector<int>* finalOwners = nullptr) {
+    vector<int> owners(size + 1, NO_OPERATION);
+    vector<int> results;
+    int rover = 0;
+
+    int requestId = 0;
+    for (size_t i = 0; i < rawRequests.size(); i += RawRequestLength(rawRequests[i])) {
+        ++requestId;
+        if (IsRevocation(rawRequests[i])) {
+            for (int cell = 1; cell <= size; ++cell) {
+                if (owners[cell] == -rawRequests[i]) {
+                    owners[cell] = NO_OPERATION;
+                }
+            }
+            continue;
+        }
+
+        int owner = requestId;
+        int requestedSize = rawRequests[i];
+        // The run of the reallocated request is [ownedBegin, ownedEnd).
+        int ownedBegin = 1;
+        int ownedEnd = 1;
+        if (rawRequests[i] == REALLOCATION_CODE) {
+            owner = rawRequests[i + 1];
+            requestedSize = rawRequests[i + 2];
+            while (ownedBegin <= size && owners[ownedBegin] != owner) {
+                ++ownedBegin;
+            }
+            if (ownedBegin > size) {
+                results.push_back(FAIL_CODE);
+                continue;
+            }
+            ownedEnd = ownedBegin;
+            while (ownedEnd <= size && owners[ownedEnd] == owner) {
+                ++ownedEnd;
+            }
+
+            int newEnd = ownedBegin + requestedSize;
+            bool canResize = newEnd <= size + 1;
+            for (int cell = ownedEnd; canResize && cell < newEnd; ++cell) {
+                canResize = owners[cell] == NO_OPERATION;
+            }
+            if (canResize) {
+                for (int cell = std::min(ownedEnd, newEnd); cell < std::max(ownedEnd, newEnd); ++cell) {
+                    owners[cell] = newEnd > ownedEnd ? owner : NO_OPERATION;
+                }
+                results.push_back(ownedBegin);
+                continue;
+            }
+        }
+
+        int bestOffset = FAIL_CODE;
+        int bestLength = -1;
+        int wrappedOffset = FAIL_CODE;
+        for (int cell = 1; cell <= size; ) {
+            int end = cell;
+            while (end <= size && owners[end] == NO_OPERATION) {
+                ++end;
+            }
+
+            int length = end - cell;
+            if (length > 0) {
+                bool better = false;
+                if (placement == "worst-fit") {
+                    better = length > bestLength;
+                } else if (placement == "best-fit") {
+                    better = length >= requestedSize &&
+                             (bestOffset == FAIL_CODE || length < bestLength);
+                } else if (placement == "first-fit") {
+                    better = length >= requestedSize && bestOffset == FAIL_CODE;
+                } else if (placement == "next-fit") {
+                    if (length >= requestedSize && wrappedOffset == FAIL_CODE) {
+                        wrappedOffset = cell;
+                    }
+                    better = length >= requestedSize && cell >= rover &&
+                             bestOffset == FAIL_CODE;
+                }
+                if (better) {
+                    bestOffset = cell;
+                    bestLength = length;
+                }
+            }
+            cell = end + 1;
+        }
+
+        if (placement == "next-fit" && bestOffset == FAIL_CODE && wrappedOffset != FAIL_CODE) {
+            bestOffset = wrappedOffset;
+            bestLength = requestedSize;
+        }
+
+        if (bestOffset == FAIL_CODE || bestLength < requestedSize) {
+            results.push_back(FAIL_CODE);
+        } else {
+            for (int cell = ownedBegin; cell < ownedEnd; ++cell) {
+                owners[cell] = NO_OPERATION;
+            }
+            for (int cell = bestOffset; cell < bestOffset + requestedSize; ++cell) {
+                owners[cell] = owner;
+            }
+            rover = bestOffset + requestedSize;
+            results.push_back(bestOffset);
+        }
+    }
+
+    if (finalOwners != nullptr) {
+        *finalOwners = owners;
+    }
+    return results;
+}
+
+vector<int> RandomRawRequests(int size, int maxRequestsCount, bool withReallocations = false) {
+    int requestsCount = Random(1, maxRequestsCount);
+    vector<int> rawRequests;
+    rawRequests.reserve(requestsCount);
+    for (int requestId = 1; requestId <= requestsCount; ++requestId) {
+        int type = Random(0, withReallocations ? 2 : 1);
+        if (type == 0) {
+            rawRequests.push_back(Random(1, size / 2 + 1));
+        } else if (type == 1) {
+            rawRequests.push_back(-Random(1, requestId));
+        } else {
+            rawRequests.push_back(REALLOCATION_CODE);
+            rawRequests.push_back(Random(1, requestId));
+            rawRequests.push_back(Random(1, size / 2 + 1));
+        }
+    }
+    return rawRequests;
+}
+
+// Compares `MemoryManager` with `ReferenceMemoryManage` on random requests.
+template <class Placement = WorstFitPlacement>
+void StressTestMemoryManage(int maxSize, int maxRequestsCount,
+                            const string& placement = "worst-fit",
+                            bool withReallocations = false) {
+    int size = Random(1, maxSize);
+    vector<int> rawRequests = RandomRawRequests(size, maxRequestsCount, withReallocations);
+    TestMemoryManage<Placement>(size, rawRequests,
+                                ReferenceMemoryManage(size, rawRequests, placement));
+}
+
+// Checks the free parts of a random range of cells
+// against the runs of free cells of the reference.
+void StressTestFreeMemoryParts(int maxSize, int maxRequestsCount) {
+    int size = Random(1, maxSize);
+    vector<int> rawRequests = RandomRawRequests(size, maxRequestsCount);
+    vector<int> owners;
+    ReferenceMemoryManage(size, rawRequests, "first-fit", &owners);
+
+    MemoryManager<FirstFitPlacement> manager(size);
+    for (size_t i = 0; i < rawRequests.size(); ++i) {
+        if (rawRequests[i] >= 0) {
+            manager.allocate(rawRequests[i]);
+        } else {
+            manager.revoke(-rawRequests[i]);
+        }
+    }
+
+    int first = Random(1, size);
+    int last = Random(first, size + 1);
+    vector<pair<MemorySize, MemorySize>> expected;
+    for (int cell = 1; cell <= size; ) {
+        int end = cell;
+        while (end <= size && owners[end] == NO_OPERATION) {
+            ++end;
+        }
+        if (end > cell && cell < last && end > first) {
+            expected.push_back(std::make_pair(cell, end - cell));
+        }
+        cell = end + 1;
+    }
+
+    CheckResult(rawRequests, manager.freeMemoryParts(first, last), expected, "freeMemoryParts");
+
+    pair<MemorySize, MemorySize> none(FAIL_CODE, 0);
+    pair<MemorySize, MemorySize> expectedBefore = none;
+    pair<MemorySize, MemorySize> expectedFrom = none;
+    for (int cell = 1; cell <= size; ) {
+        int end = cell;
+        while (end <= size && owners[end] == NO_OPERATION) {
+            ++end;
+        }
+        if (end > cell && cell < first) {
+            expectedBefore = std::make_pair(cell, end - cell);
+        }
+        if (end > cell && cell >= first && expectedFrom == none) {
+            expectedFrom = std::make_pair(cell, end - cell);
+        }
+        cell = end + 1;
+    }
+    CheckResult(first, manager.freePartBefore(first), expectedBefore, "freePartBefore");
+    CheckResult(first, manager.freePartFrom(first), expectedFrom, "freePartFrom");
+}
+
+// Checks the free neighbours of an offset inside a free part, at its
+// start, before the first part and past the last one.
+void TestFreePartNeighbours() {
+    MemoryManager<FirstFitPlacement> manager(10);
+    manager.allocate(3);
+    manager.allocate(2);
+    manager.allocate(2);
+    manager.revoke(2);
+    // The free parts are [4, 5] and [8, 10].
+    typedef pair<MemorySize, MemorySize> Part;
+    const Part none(FAIL_CODE, 0);
+    vector<Part> before{manager.freePartBefore(1), manager.freePartBefore(4),
+                        manager.freePartBefore(5), manager.freePartBefore(8),
+                        manager.freePartBefore(11)};
+    CheckResult(10, before, vector<Part>{none, none, Part(4, 2), Part(4, 2), Part(8, 3)},
+                "freePartBefore");
+    vector<Part> from{manager.freePartFrom(1), manager.freePartFrom(4),
+                      manager.freePartFrom(5), manager.freePartFrom(8),
+                      manager.freePartFrom(11)};
+    CheckResult(10, from, vector<Part>{Part(4, 2), Part(4, 2), Part(8, 3), Part(8, 3), none},
+                "freePartFrom");
+}
 
-public:
-    explicit AllocationRequest(int size)
-        : size_(size)
-    {
-        type_ = ALLOCATION;
-    }
+// Checks that the allocations with the size classes stay inside the memory
+// and never overlap the live allocations.
+void StressTestSizeClasses(int maxSize, int maxRequestsCount, const vector<int>& sizeClasses) {
+    int size = Random(1, maxSize);
+    vector<int> rawRequests = RandomRawRequests(size, maxRequestsCount);
+    MemoryManagerOptions options;
+    options.sizeClasses = sizeClasses;
+    MemoryManager<> manager(size, options);
 
-    int size() const {
-        return size_;
+    vector<int> owners(size + 1, NO_OPERATION);
+    for (size_t i = 0; i < rawRequests.size(); ++i) {
+        int requestId = i + 1;
+        if (rawRequests[i] < 0) {
+            manager.revoke(-rawRequests[i]);
+            for (int cell = 1; cell <= size; ++cell) {
+                if (owners[cell] == -rawRequests[i]) {
+                    owners[cell] = NO_OPERATION;
+                }
+            }
+            continue;
+        }
+
+        int offset = manager.allocate(rawRequests[i]);
+        bool correct = offset == FAIL_CODE ||
+                       (offset >= 1 && offset + rawRequests[i] - 1 <= size);
+        for (int cell = offset; correct && offset != FAIL_CODE &&
+                                cell < offset + rawRequests[i]; ++cell) {
+            correct = owners[cell] == NO_OPERATION;
+            owners[cell] = requestId;
+        }
+        CheckResult(rawRequests, correct, true, "allocate with size classes");
     }
+}
 
-private:
-    int size_;
-};
+void TestSizeClassesAll() {
+    MemoryManagerOptions options;
+    options.sizeClasses = vector<int>{4, 2};
 
-class RevocationRequest : public Request {
-    Request* readInput(istream& stream);
+    // The revoked part of the first request is reused by the third one.
+    TestMemoryManage(12, vector<int>{1, 3, -1, 2, 5}, vector<int>{1, 3, 1, 7}, options);
+    // The cached parts are merged when an allocation fails.
+    TestMemoryManage(6, vector<int>{2, 2, 2, -1, -2, 4}, vector<int>{1, 3, 5, 1}, options);
+    // Without the size classes the third allocation would take 7.
+    TestMemoryManage(12, vector<int>{1, 3, -1, 2, 5}, vector<int>{1, 2, 5, 7});
 
-public:
-    explicit RevocationRequest(int operation)
-        : operationForRevoke_(operation)
-    {
-        type_ = REVOCATION;
+    CheckResult(8, PowerOfTwoSizeClasses(8), vector<int>{1, 2, 4, 8}, "PowerOfTwoSizeClasses");
+
+    const vector<string> descriptions{"pow2:4", "8,2,4,2", "5", "pow2:0", "pow2:", "2,0",
+                                      "2,-4", "2,x", "2,,4", "2,", "", " 2", "2147483648"};
+    vector<vector<int>> parsed;
+    for (size_t i = 0; i < descriptions.size(); ++i) {
+        vector<int> sizeClasses{-1};
+        if (!ParseSizeClasses(descriptions[i], sizeClasses)) {
+            sizeClasses = vector<int>{0};
+        }
+        parsed.push_back(sizeClasses);
     }
+    const vector<int> rejected{0};
+    CheckResult(descriptions, parsed,
+                vector<vector<int>>{{1, 2, 4}, {2, 4, 8}, {5}, rejected, rejected, rejected,
+                                    rejected, rejected, rejected, rejected, rejected, rejected,
+                                    rejected},
+                "ParseSizeClasses");
 
-    int operationForRevoke() const {
-        return operationForRevoke_;
+    bool thrown = false;
+    try {
+        MemoryManagerOptions withZeroClass;
+        withZeroClass.sizeClasses = vector<int>{0, 2};
+        MemoryManager<> manager(10, withZeroClass);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
     }
+    CheckResult(0, thrown, true, "MemoryManager with a zero size class");
 
-private:
-    int operationForRevoke_;
-};
+    const size_t testCount = 1000;
+    RunStressTest("StressTestSizeClasses", 07012014, testCount, [&] {
+        StressTestSizeClasses(50, 50, PowerOfTwoSizeClasses(8));
+        StressTestSizeClasses(50, 50, vector<int>{3, 5});
+    });
+}
 
-Request* readInput(istream& stream) {
-    int rawRequest;
-    stream >> rawRequest;
+// Checks that the allocations with deferred merging never overlap the live
+// allocations and fail only if there is no free run of the requested size.
+void StressTestDeferredMerging(int maxSize, int maxRequestsCount, int pendingLimit) {
+    int size = Random(1, maxSize);
+    vector<int> rawRequests = RandomRawRequests(size, maxRequestsCount);
+    MemoryManagerOptions options;
+    options.pendingLimit = pendingLimit;
+    MemoryManager<> manager(size, options);
 
-    if (rawRequest >= 0) {
-        return new AllocationRequest(rawRequest);
-    } else {
-        return new RevocationRequest(-rawRequest);
+    vector<int> owners(size + 1, NO_OPERATION);
+    for (size_t i = 0; i < rawRequests.size(); ++i) {
+        int requestId = i + 1;
+        if (rawRequests[i] < 0) {
+            manager.revoke(-rawRequests[i]);
+            for (int cell = 1; cell <= size; ++cell) {
+                if (owners[cell] == -rawRequests[i]) {
+                    owners[cell] = NO_OPERATION;
+                }
+            }
+            continue;
+        }
+
+        int offset = manager.allocate(rawRequests[i]);
+        bool correct;
+        if (offset == FAIL_CODE) {
+            int longestRun = 0;
+            for (int cell = 1, run = 0; cell <= size; ++cell) {
+                run = owners[cell] == NO_OPERATION ? run + 1 : 0;
+                longestRun = std::max(longestRun, run);
+            }
+            correct = longestRun < rawRequests[i];
+        } else {
+            correct = offset >= 1 && offset + rawRequests[i] - 1 <= size;
+            for (int cell = offset; correct && cell < offset + rawRequests[i]; ++cell) {
+                correct = owners[cell] == NO_OPERATION;
+                owners[cell] = requestId;
+            }
+        }
+        CheckResult(rawRequests, correct, true, "allocate with deferred merging");
     }
 }
 
-int processRequest(MemoryManager& memoryManager, const Request& request) {
-    switch (request.type()) {
-    case ALLOCATION:
-        return memoryManager.allocate(request.size());
-        break;
-    case REVOCATION:
-        memoryManager.revoke(request.operationForRevoke());
-        break;
-    default:
-        throw UnknownRequestTypeException();
+void TestDeferredMergingAll() {
+    MemoryManagerOptions options;
+    options.pendingLimit = 2;
+
+    // The pending parts are merged when an allocation fails.
+    TestMemoryManage(6, vector<int>{2, 2, 2, -1, -2, 4}, vector<int>{1, 3, 5, 1}, options);
+    // The pending part is not used, the eager merging would give 1.
+    TestMemoryManage(12, vector<int>{5, -1, 3}, vector<int>{1, 6}, options);
+    // The second pending part reaches the limit and both are merged.
+    TestMemoryManage(12, vector<int>{4, 4, -1, -2, 3}, vector<int>{1, 5, 1}, options);
+
+    const size_t testCount = 1000;
+    RunStressTest("StressTestDeferredMerging", 07012014, testCount, [&] {
+        StressTestDeferredMerging(50, 50, 1);
+        StressTestDeferredMerging(50, 50, 4);
+        StressTestDeferredMerging(50, 100, 1000);
+    });
+}
+
+template <class Manager>
+vector<MemorySize> ProcessRawRequests(Manager& manager, const vector<int>& rawRequests) {
+    vector<MemorySize> results;
+    for (size_t i = 0; i < rawRequests.size(); i += RawRequestLength(rawRequests[i])) {
+        if (rawRequests[i] >= 0) {
+            results.push_back(manager.allocate(rawRequests[i]));
+        } else if (rawRequests[i] != REALLOCATION_CODE) {
+            manager.revoke(-rawRequests[i]);
+        } else {
+            results.push_back(manager.reallocate(rawRequests[i + 1], rawRequests[i + 2]));
+        }
     }
+    return results;
 }
 
-void TestAll();
+// Compares `process` on random requests with reallocations
+// with the requests processed one by one.
+void StressTestReallocateBatch(int maxSize, int maxRequestsCount) {
+    int size = Random(1, maxSize);
+    vector<int> rawRequests = RandomRawRequests(size, maxRequestsCount, true);
+    MemoryManager<> sequentialManager(size);
+    vector<MemorySize> expected = ProcessRawRequests(sequentialManager, rawRequests);
 
-int main(int argc, char *argv[]) {  
-    if (argc == 2 && std::string(argv[1]) == "--test") {
-        TestAll();
-    } else {
-        int memorySize;
-        int requestNumber;
-        cin >> memorySize >> requestNumber;
-        MemoryManager memoryManager(memorySize);
+    MemoryManager<> batchManager(size);
+    vector<MemorySize> results(rawRequests.size());
+    results.resize(batchManager.process(rawRequests.data(), rawRequests.size(), results.data()));
+    CheckResult(rawRequests, results, expected, "process with reallocations");
+}
+
+void TestReallocateAll() {
+    const int R = REALLOCATION_CODE;
+    // Shrinks in place, grows into the free tail, grows into the freed cell,
+    // fails to move, grows after the second request is revoked.
+    TestMemoryManage(10, vector<int>{3, 2, R, 1, 2, R, 2, 5, R, 1, 3, R, 1, 6, -2, R, 1, 6},
+                     vector<int>{1, 4, 1, 4, 1, -1, 1});
+    // Moves, and the old cells are free again.
+    TestMemoryManage(10, vector<int>{2, 2, R, 1, 3, 2, 2, R, 9, 1},
+                     vector<int>{1, 3, 5, 8, 1, -1});
+    // The grown part is rounded to the class and reused from its free list.
+    MemoryManagerOptions options;
+    options.sizeClasses = vector<int>{2, 4};
+    TestMemoryManage(8, vector<int>{1, R, 1, 3, -1, 4, 4}, vector<int>{1, 1, 1, 5}, options);
+
+    const size_t testCount = 1000;
+    RunStressTest("StressTestMemoryManage", 07012014, testCount, [&] {
+        StressTestMemoryManage<WorstFitPlacement>(50, 50, "worst-fit", true);
+        StressTestMemoryManage<BestFitPlacement>(50, 50, "best-fit", true);
+        StressTestMemoryManage<FirstFitPlacement>(50, 50, "first-fit", true);
+        StressTestMemoryManage<NextFitPlacement>(50, 50, "next-fit", true);
+        StressTestReallocateBatch(50, 100);
+    });
+}
+
+// Updates the offsets of the live allocations by the relocations.
+void ApplyRelocations(const vector<Relocation>& relocations, vector<int>& offsets) {
+    for (size_t i = 0; i < relocations.size(); ++i) {
+        std::replace(offsets.begin(), offsets.end(), relocations[i].oldOffset,
+                     relocations[i].newOffset);
+    }
+}
+
+// Interleaves random requests with random compaction steps, follows the
+// relocations and checks that the live allocations stay inside the memory
+// and never overlap. Then two full passes leave at most one free part.
+template <class Placement>
+void StressTestCompaction(int maxSize, int maxRequestsCount, const MemoryManagerOptions& options) {
+    int size = Random(1, maxSize);
+    vector<int> rawRequests = RandomRawRequests(size, maxRequestsCount, true);
+    MemoryManager<Placement> manager(size, options);
+
+    // By the request numbers, `FAIL_CODE` if the allocation is not live.
+    vector<int> offsets(rawRequests.size() + 1, FAIL_CODE);
+    vector<int> sizes(rawRequests.size() + 1, 0);
+    vector<Relocation> relocations;
+    auto relocate = [&]() {
+        manager.takeRelocations(relocations);
+        ApplyRelocations(relocations, offsets);
+    };
+    auto checkAllocations = [&]() {
+        relocate();
+        vector<bool> occupied(size + 1, false);
+        bool correct = true;
+        for (size_t id = 1; id < offsets.size(); ++id) {
+            for (int cell = offsets[id]; offsets[id] != FAIL_CODE &&
+                                         cell < offsets[id] + sizes[id]; ++cell) {
+                correct = correct && cell >= 1 && cell <= size && !occupied[cell];
+                occupied[std::min(std::max(cell, 0), size)] = true;
+            }
+        }
+        CheckResult(rawRequests, correct, true, "compact");
+    };
 
-        for (int i = 0; i < requestNumber; ++i) {
-            Request* request = readInput(cin);
-            int result = processRequest(memoryManager, *request);
-            if (request->type() == ALLOCATION) {
-                cout << result << endl;
+    int requestId = 0;
+    for (size_t i = 0; i < rawRequests.size(); i += RawRequestLength(rawRequests[i])) {
+        ++requestId;
+        RawRequest request = DecodeRequest(&rawRequests[i]);
+        // The relocations of a request are made before it is served.
+        if (request.type == ALLOCATION) {
+            int offset = manager.allocate(request.value);
+            relocate();
+            offsets[requestId] = offset;
+            sizes[requestId] = request.value;
+        } else if (request.type == REVOCATION) {
+            manager.revoke(request.value);
+            relocate();
+            offsets[request.value] = FAIL_CODE;
+        } else {
+            int offset = manager.reallocate(request.value, request.size);
+            relocate();
+            if (offset != FAIL_CODE) {
+                offsets[request.value] = offset;
+                sizes[request.value] = request.size;
             }
-            delete request;
+        }
+        if (Random(0, 3) == 0) {
+            manager.compact(Random(1, 8));
+        }
+        checkAllocations();
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        while (!manager.compact(Random(1, 8))) {
         }
     }
-    return 0;
+    checkAllocations();
+    MemoryManagerStats stats = manager.stats();
+    CheckResult(rawRequests, stats.freePartsCount <= 1 && stats.largestFreePart == stats.freeCells,
+                true, "full compaction pass");
 }
 
-//############################Testing################################
+void TestCompactionAll() {
+    // The third allocation moves into the revoked second one.
+    MemoryManager<> manager(10);
+    ProcessRawRequests(manager, vector<int>{2, 2, 2, -2});
+    CheckResult(10, manager.allocate(6), FAIL_CODE, "allocate before compaction");
+    size_t stepsCount = 1;
+    while (!manager.compact(1)) {
+        ++stepsCount;
+    }
+    // Skips the first allocation, absorbs the free part, moves the third
+    // allocation, absorbs the free tail, ends.
+    CheckResult(10, stepsCount, size_t(5), "compact steps");
+    vector<Relocation> relocations;
+    manager.takeRelocations(relocations);
+    CheckResult(10, relocations, vector<Relocation>{Relocation{5, 3}}, "compact relocations");
+    CheckResult(10, manager.allocate(6), 5, "allocate after compaction");
+    manager.revoke(3);
+    CheckResult(10, manager.allocate(2), 3, "revoke of a moved allocation");
 
-template<typename T>
-ostream& operator << (ostream& stream, const vector<T>& vec) {
-    stream << "{";
-    for (size_t i = 0; i < vec.size(); ++i) {
-        stream << vec[i];
-        if (i + 1 < vec.size()) {
-            stream << ",";
-        }
+    // An allocation that fails with the gap ends the pass.
+    MemoryManager<> interrupted(10);
+    ProcessRawRequests(interrupted, vector<int>{2, 2, 2, -2});
+    interrupted.compact(3);
+    CheckResult(10, interrupted.allocate(6), 5, "allocate during compaction");
+    CheckResult(10, interrupted.compact(1), false, "compact after the ended pass");
+
+    // The automatic pass starts when the second free part appears.
+    MemoryManagerOptions options;
+    options.compactionThreshold = 2;
+    options.compactionSteps = 100;
+    MemoryManager<> automatic(10, options);
+    CheckResult(10, ProcessRawRequests(automatic, vector<int>{2, 2, 2, -2, 6}),
+                vector<MemorySize>{1, 3, 5, 5}, "automatic compaction");
+    automatic.takeRelocations(relocations);
+    CheckResult(10, relocations, vector<Relocation>{Relocation{5, 3}},
+                "automatic compaction relocations");
+
+    MemoryManagerOptions withSizeClasses;
+    withSizeClasses.sizeClasses = PowerOfTwoSizeClasses(4);
+    MemoryManagerOptions withPendingParts;
+    withPendingParts.pendingLimit = 4;
+    MemoryManagerOptions withAutomaticCompaction;
+    withAutomaticCompaction.compactionThreshold = 3;
+    withAutomaticCompaction.compactionSteps = 2;
+
+    const size_t testCount = 1000;
+    RunStressTest("StressTestCompaction", 07012014, testCount, [&] {
+        StressTestCompaction<WorstFitPlacement>(50, 100, MemoryManagerOptions());
+        StressTestCompaction<WorstFitPlacement>(50, 100, withSizeClasses);
+        StressTestCompaction<WorstFitPlacement>(50, 100, withPendingParts);
+        StressTestCompaction<WorstFitPlacement>(50, 100, withAutomaticCompaction);
+        StressTestCompaction<FirstFitPlacement>(50, 100, withAutomaticCompaction);
+        StressTestCompaction<NextFitPlacement>(50, 100, MemoryManagerOptions());
+    });
+}
+
+// Returns the snapshot of the manager.
+template <class Placement>
+vector<char> SnapshotOf(const MemoryManager<Placement>& manager) {
+    FILE* file = std::tmpfile();
+    manager.saveSnapshot(file);
+    std::rewind(file);
+    vector<char> snapshot;
+    int symbol;
+    while ((symbol = std::fgetc(file)) != EOF) {
+        snapshot.push_back(symbol);
     }
-    return stream << "}";
+    std::fclose(file);
+    return snapshot;
 }
 
-// Compares calculated value `result` with the right value `expected`.
-// If result differ from expected, throws RuntimeError
-template<typename T, typename U, typename V>
-void CheckResult(T input, U result, V expected, string functionName) {
-    if (!(result == expected)) {
-        cerr << "While testing " << functionName << ". "
-             << "For input "     << input
-             << " expected "     << expected
-             << " but got "      << result       << endl;
-        throw runtime_error("Test failed");
+// Saves the manager in the middle of random requests, restores it in
+// another one and checks that both give the same results to the end.
+template <class Placement>
+void StressTestSnapshot(int maxSize, int maxRequestsCount, const MemoryManagerOptions& options) {
+    int size = Random(1, maxSize);
+    vector<int> rawRequests = RandomRawRequests(size, maxRequestsCount);
+    size_t middle = Random(0, rawRequests.size());
+    vector<int> firstHalf(rawRequests.begin(), rawRequests.begin() + middle);
+    vector<int> secondHalf(rawRequests.begin() + middle, rawRequests.end());
+
+    MemoryManager<Placement> original(size, options);
+    ProcessRawRequests(original, firstHalf);
+    vector<char> snapshot = SnapshotOf(original);
+
+    MemoryManager<Placement> restored(1);
+    restored.loadSnapshot(snapshot.data(), snapshot.data() + snapshot.size());
+    vector<MemorySize> expected = ProcessRawRequests(original, secondHalf);
+    vector<MemorySize> results = ProcessRawRequests(restored, secondHalf);
+    CheckResult(rawRequests, results, expected, "loadSnapshot");
+    CheckResult(rawRequests, restored.lastRequestNumber(), original.lastRequestNumber(),
+                "lastRequestNumber after loadSnapshot");
+}
+
+// Corrupts the bytes of the snapshot one by one: the manager must either
+// throw `InvalidSnapshotException` or go on with the loaded state.
+// Returns the number of the rejected snapshots.
+template <class Placement>
+size_t LoadCorruptedSnapshots(const vector<int>& rawRequests, const MemoryManagerOptions& options) {
+    MemoryManager<Placement> manager(20, options);
+    ProcessRawRequests(manager, rawRequests);
+    const vector<char> snapshot = SnapshotOf(manager);
+
+    size_t rejectedCount = 0;
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        for (char corruption : {'\x01', '\x80', '\xFF'}) {
+            vector<char> corrupted = snapshot;
+            corrupted[i] ^= corruption;
+            MemoryManager<Placement> restored(1);
+            try {
+                restored.loadSnapshot(corrupted.data(), corrupted.data() + corrupted.size());
+            } catch (const InvalidSnapshotException&) {
+                ++rejectedCount;
+                continue;
+            }
+            ProcessRawRequests(restored, rawRequests);
+        }
     }
+    return rejectedCount;
 }
-        
-void CheckHeap(const vector<int>& input, const Heap<int>& heap, string methodName) {
-    // If heap is correct make_heap won't change `answer`.
-    vector<int> answer = heap.elements_;
-    make_heap(answer.begin(), answer.end());
-    CheckResult(input, heap.elements_, answer, methodName + " of the Heap");
+
+void TestSnapshotAll() {
+    MemoryManager<> manager(10);
+    ProcessRawRequests(manager, vector<int>{3, 4, -1});
+    vector<char> snapshot = SnapshotOf(manager);
+    MemoryManager<> restored(1);
+    restored.loadSnapshot(snapshot.data(), snapshot.data() + snapshot.size());
+    CheckResult(snapshot.size(), SnapshotOf(restored) == snapshot, true, "saveSnapshot after loadSnapshot");
+
+    bool thrown = false;
+    try {
+        restored.loadSnapshot(snapshot.data(), snapshot.data() + snapshot.size() / 2);
+    } catch (const InvalidSnapshotException&) {
+        thrown = true;
+    }
+    CheckResult(snapshot.size(), thrown, true, "loadSnapshot of a truncated snapshot");
+
+    thrown = false;
+    try {
+        MemoryManager<BestFitPlacement> otherPlacement(1);
+        otherPlacement.loadSnapshot(snapshot.data(), snapshot.data() + snapshot.size());
+    } catch (const InvalidSnapshotException&) {
+        thrown = true;
+    }
+    CheckResult(snapshot.size(), thrown, true, "loadSnapshot with another placement");
+
+    MemoryManagerOptions withSizeClasses;
+    withSizeClasses.sizeClasses = PowerOfTwoSizeClasses(4);
+    MemoryManagerOptions withPendingParts;
+    withPendingParts.pendingLimit = 4;
+    // The passes span several requests, so the gap is saved.
+    MemoryManagerOptions withCompaction;
+    withCompaction.compactionThreshold = 3;
+    withCompaction.compactionSteps = 2;
+
+    // The requests leave free, occupied, cached and pending parts.
+    const vector<int> corruptedRequests{3, 2, 4, 1, 2, 5, -1, -3, -5, 1};
+    vector<size_t> rejectedCounts{
+        LoadCorruptedSnapshots<WorstFitPlacement>(corruptedRequests, withSizeClasses),
+        LoadCorruptedSnapshots<WorstFitPlacement>(corruptedRequests, withPendingParts),
+        LoadCorruptedSnapshots<WorstFitPlacement>(corruptedRequests, withCompaction),
+        LoadCorruptedSnapshots<BestFitPlacement>(corruptedRequests, withSizeClasses),
+        LoadCorruptedSnapshots<NextFitPlacement>(corruptedRequests, withPendingParts)
+    };
+    for (size_t i = 0; i < rejectedCounts.size(); ++i) {
+        CheckResult(corruptedRequests, rejectedCounts[i] > 0, true, "loadSnapshot of a corrupted snapshot");
+    }
+
+    const size_t testCount = 1000;
+    RunStressTest("StressTestSnapshot", 07012014, testCount, [&] {
+        StressTestSnapshot<WorstFitPlacement>(50, 100, MemoryManagerOptions());
+        StressTestSnapshot<WorstFitPlacement>(50, 100, withSizeClasses);
+        StressTestSnapshot<WorstFitPlacement>(50, 100, withPendingParts);
+        StressTestSnapshot<WorstFitPlacement>(50, 100, withCompaction);
+        StressTestSnapshot<BestFitPlacement>(50, 100, MemoryManagerOptions());
+        StressTestSnapshot<NextFitPlacement>(50, 100, MemoryManagerOptions());
+    });
 }
 
-// Returns a random number from the range.
-int Random(int rangeMin, int rangeMax) {
-    int rangeSize = rangeMax - rangeMin + 1;
-    return rangeMin + rand() % rangeSize;
+void TestStatsAll() {
+    const vector<int> rawRequests{3, 2, -1, 6};
+    MemoryManager<> manager(10);
+    ProcessRawRequests(manager, rawRequests);
+    MemoryManagerStats stats = manager.stats();
+
+    vector<int64_t> cells{stats.freeCells, stats.usedCells, stats.deferredCells,
+                          int64_t(stats.freePartsCount), stats.largestFreePart};
+    CheckResult(rawRequests, cells, vector<int64_t>{8, 2, 0, 2, 5}, "stats");
+    CheckResult(rawRequests, stats.fragmentation, 0.375, "stats fragmentation");
+    vector<uint64_t> sizes{stats.freePartSizes.count(1), stats.freePartSizes.count(2)};
+    CheckResult(rawRequests, sizes, vector<uint64_t>{1, 1}, "stats free part sizes");
+#ifdef MEMORY_MANAGER_STATS
+    CheckResult(rawRequests, stats.failedAllocations, uint64_t(1), "stats failed allocations");
+    uint64_t allocationsCount = 0;
+    for (int bucket = 0; bucket < Log2Histogram::BUCKETS_COUNT; ++bucket) {
+        allocationsCount += stats.allocationLatency.count(bucket);
+    }
+    CheckResult(rawRequests, allocationsCount, uint64_t(3), "stats allocation latency");
+#endif
+
+    MemoryManagerOptions options;
+    options.pendingLimit = 4;
+    MemoryManager<> deferringManager(10, options);
+    ProcessRawRequests(deferringManager, vector<int>{3, -1});
+    CheckResult(vector<int>{3, -1}, deferringManager.stats().deferredCells, int64_t(3),
+                "stats of pending parts");
 }
 
-vector<int> RandomVector(int maxLength, int maxItemAbs) {
-    vector<int> randomVector(Random(1, maxLength));
-    for (size_t i = 0; i < randomVector.size(); ++i) {
-        randomVector[i] = Random(-maxItemAbs, maxItemAbs);
+// Checks that `process` gives the same results as `ProcessRawRequests`
+// when the requests are split into random batches.
+template <class Manager>
+void StressTestProcessBatch(int maxSize, int maxRequestsCount) {
+    int size = Random(1, maxSize);
+    vector<int> rawRequests = RandomRawRequests(size, maxRequestsCount);
+    Manager sequentialManager(size);
+    vector<MemorySize> expected = ProcessRawRequests(sequentialManager, rawRequests);
+
+    Manager batchManager(size);
+    vector<MemorySize> results(rawRequests.size());
+    size_t resultsCount = 0;
+    for (size_t begin = 0; begin < rawRequests.size(); ) {
+        size_t count = std::min<size_t>(Random(0, 20), rawRequests.size() - begin);
+        resultsCount += batchManager.process(rawRequests.data() + begin, count,
+                                             results.data() + resultsCount);
+        begin += count;
     }
-    return randomVector;
+    results.resize(resultsCount);
+
+    CheckResult(rawRequests, results, expected, "process");
 }
 
-void TestHeapConstructor(const vector<int>& input) {
-    Heap<int> heap(input);
-    CheckHeap(input, heap, "single parameter constructor");
+// Checks that the bulk rebuilds of the placement index on the bursts of
+// revocations give the same results as the incremental updates.
+template <class Placement>
+void StressTestBulkRelease(int maxSize, int maxBurstsCount, MemoryManagerOptions options) {
+    int size = Random(1, maxSize);
+    vector<int> rawRequests;
+    int burstsCount = Random(1, maxBurstsCount);
+    for (int burst = 0; burst < burstsCount; ++burst) {
+        vector<int> allocations;
+        for (int allocationsCount = Random(1, 20); allocationsCount > 0; --allocationsCount) {
+            rawRequests.push_back(Random(1, std::max(size / 4, 1)));
+            allocations.push_back(rawRequests.size());
+        }
+        for (int i = allocations.size() - 1; i > 0; --i) {
+            swap(allocations[i], allocations[Random(0, i)]);
+        }
+        allocations.resize(Random(0, allocations.size()));
+        for (size_t i = 0; i < allocations.size(); ++i) {
+            rawRequests.push_back(-allocations[i]);
+        }
+    }
+
+    options.bulkReleaseRatio = 0;
+    MemoryManager<Placement> incrementalManager(size, options);
+    vector<MemorySize> expected(rawRequests.size());
+    expected.resize(incrementalManager.process(rawRequests.data(), rawRequests.size(),
+                                               expected.data()));
+
+    options.bulkReleaseRatio = 1;
+    MemoryManager<Placement> bulkManager(size, options);
+    vector<MemorySize> results(rawRequests.size());
+    results.resize(bulkManager.process(rawRequests.data(), rawRequests.size(), results.data()));
+
+    CheckResult(rawRequests, results, expected, "process with bulk release");
 }
 
-void StressTestConstructor(int maxLength, int maxItemAbs) {
-    vector<int> input = RandomVector(maxLength, maxItemAbs);
-    TestHeapConstructor(input);
+void TestProcessBatchAll() {
+    MemoryManager<> manager(6);
+    const vector<int> rawRequests{2, 3, -1, 3, 3, -5, 2, 2};
+    vector<MemorySize> results(rawRequests.size());
+    results.resize(manager.process(rawRequests.data(), rawRequests.size(), results.data()));
+    CheckResult(rawRequests, results, vector<MemorySize>{1, 3, -1, -1, 1, -1}, "process");
+
+    const size_t testCount = 1000;
+    RunStressTest("StressTestProcessBatch", 07012014, testCount, [&] {
+        StressTestProcessBatch<MemoryManager<WorstFitPlacement>>(50, 100);
+        StressTestProcessBatch<MemoryManager<FirstFitPlacement>>(50, 100);
+        StressTestProcessBatch<BuddyMemoryManager>(50, 100);
+    });
+
+    MemoryManagerOptions withSizeClasses;
+    withSizeClasses.sizeClasses = PowerOfTwoSizeClasses(4);
+    MemoryManagerOptions withPendingParts;
+    withPendingParts.pendingLimit = 8;
+    RunStressTest("StressTestBulkRelease", 07012014, testCount, [&] {
+        StressTestBulkRelease<WorstFitPlacement>(200, 20, MemoryManagerOptions());
+        StressTestBulkRelease<WorstFitPlacement>(200, 20, withSizeClasses);
+        StressTestBulkRelease<WorstFitPlacement>(200, 20, withPendingParts);
+        StressTestBulkRelease<BestFitPlacement>(200, 20, MemoryManagerOptions());
+    });
 }
 
-void TestHeapConstructorAll() {
-    TestHeapConstructor(vector<int>{1, 2, 3, 4, 5});
-    TestHeapConstructor(vector<int>{5, 4, 3, 2, 1});
-    TestHeapConstructor(vector<int>{3, 5, 2, 1, 4});
-    TestHeapConstructor(vector<int>{5, 5, 5, 5, 5});
-    TestHeapConstructor(vector<int>{10});
+// Runs threads allocating and revoking concurrently, each allocated cell
+// is marked by its owner to check that live allocations never overlap.
+// Some revocations are handed over to the next thread.
+void StressTestShardedMemoryManager(size_t threadsCount, size_t operationsPerThread) {
+    typedef ShardedMemoryManager::Handle Handle;
+    const int memorySize = 5000;
+    ShardedMemoryManager memoryManager(memorySize, threadsCount);
+    vector<std::atomic<int>> owners(memorySize + 1);
+    std::atomic<bool> overlapped(false);
+    vector<std::unique_ptr<MpscQueue<Handle>>> inboxes;
+    for (size_t thread = 0; thread < threadsCount; ++thread) {
+        inboxes.emplace_back(new MpscQueue<Handle>(1 << 12));
+    }
 
-    srand(07012014);
-    const size_t smallTestCount = 1000;
-    for (size_t testNum = 1; testNum <= smallTestCount; ++testNum) {
-        cout << "Test " << testNum << endl;
-        StressTestConstructor(10, 10);
+    auto work = [&](size_t threadIndex) {
+        std::mt19937 random(threadIndex + 1);
+        vector<pair<ShardedMemoryManager::Allocation, int>> live;
+        for (size_t operation = 0; operation < operationsPerThread; ++operation) {
+            Handle handle;
+            while (inboxes[threadIndex]->pop(handle)) {
+                memoryManager.revoke(handle);
+            }
+
+            if (live.empty() || random() % 2 == 0) {
+                int size = 1 + random() % 100;
+                ShardedMemoryManager::Allocation allocation = memoryManager.allocate(threadIndex, size);
+                if (allocation.offset == FAIL_CODE) {
+                    continue;
+                }
+                for (int cell = allocation.offset; cell < allocation.offset + size; ++cell) {
+                    int free = 0;
+                    if (!owners[cell].compare_exchange_strong(free, threadIndex + 1)) {
+                        overlapped = true;
+                    }
+                }
+                live.push_back(std::make_pair(allocation, size));
+            } else {
+                size_t position = random() % live.size();
+                ShardedMemoryManager::Allocation allocation = live[position].first;
+                for (int cell = allocation.offset;
+                     cell < allocation.offset + live[position].second; ++cell) {
+                    owners[cell] = 0;
+                }
+                live[position] = live.back();
+                live.pop_back();
+
+                MpscQueue<Handle>& nextInbox = *inboxes[(threadIndex + 1) % threadsCount];
+                if (random() % 4 != 0 || !nextInbox.push(allocation.handle)) {
+                    memoryManager.revoke(allocation.handle);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < live.size(); ++i) {
+            for (int cell = live[i].first.offset;
+                 cell < live[i].first.offset + live[i].second; ++cell) {
+                owners[cell] = 0;
+            }
+            memoryManager.revoke(live[i].first.handle);
+        }
+    };
+
+    vector<std::thread> threads;
+    for (size_t thread = 0; thread < threadsCount; ++thread) {
+        threads.emplace_back(work, thread);
     }
+    for (size_t thread = 0; thread < threadsCount; ++thread) {
+        threads[thread].join();
+    }
+    for (size_t thread = 0; thread < threadsCount; ++thread) {
+        Handle handle;
+        while (inboxes[thread]->pop(handle)) {
+            memoryManager.revoke(handle);
+        }
+    }
+    CheckResult(threadsCount, overlapped.load(), false, "ShardedMemoryManager overlapping");
 
-    const size_t bigTestCount = 1000;
-    for (size_t testNum = smallTestCount + 1; testNum <= bigTestCount; ++testNum) {
-        cout << "Test " << testNum << endl;
-        StressTestConstructor(100, 1000);
+    // Everything is revoked, so every shard is whole again.
+    for (size_t shard = 0; shard < threadsCount; ++shard) {
+        int shardSize = memorySize / threadsCount;
+        CheckResult(threadsCount, memoryManager.allocate(shard, shardSize).offset,
+                    1 + int(shard * shardSize), "ShardedMemoryManager revoke");
     }
 }
 
-void TestHeapInsert(const vector<int>& currentHeap, int newElement) {
-    Heap<int> heap(currentHeap);
-    heap.insert(newElement);
-    CheckHeap(currentHeap, heap, "insert");
+// Checks that the generated revocations take the live allocations
+// in the order of the workload.
+void TestWorkloadGenerator(Workload::Order order) {
+    Workload workload = {"test", Workload::POWER_LAW_SIZES, order};
+    WorkloadGenerator generator(workload);
+    vector<int> rawRequests;
+    generator.generate(20000, rawRequests);
+
+    std::set<int> live;
+    bool ordered = true;
+    for (size_t i = 0; i < rawRequests.size(); ++i) {
+        if (rawRequests[i] > 0) {
+            ordered = ordered && rawRequests[i] <= Workload::MAX_SIZE;
+            live.insert(i + 1);
+            continue;
+        }
+        int revoked = -rawRequests[i];
+        ordered = ordered && live.count(revoked) == 1 &&
+                  (order != Workload::LIFO || revoked == *live.rbegin()) &&
+                  (order != Workload::FIFO || revoked == *live.begin());
+        live.erase(revoked);
+    }
+    CheckResult(order, ordered, true, "WorkloadGenerator");
+    CheckResult(order, generator.peakLiveCount() >= live.size(), true,
+                "WorkloadGenerator peak live count");
 }
 
-void StressTestInsert(int maxLength, int maxItemAbs, int maxInsertionsCount) {
-    vector<int> input = RandomVector(maxLength, maxItemAbs);
+void TestWorkloadGeneratorAll() {
+    TestWorkloadGenerator(Workload::LIFO);
+    TestWorkloadGenerator(Workload::FIFO);
+    TestWorkloadGenerator(Workload::RANDOM);
+    TestWorkloadGenerator(Workload::MIXED_LIFETIMES);
+}
 
-    int insertionsCount = Random(0, maxInsertionsCount);
-    for (size_t testNum = 1; testNum <= insertionsCount; ++testNum) {
-        int newElement = Random(-maxItemAbs, maxItemAbs);
-        TestHeapInsert(input, newElement);
+void TestShardedMemoryManagerAll() {
+    ShardedMemoryManager memoryManager(8, 2);
+    ShardedMemoryManager::Allocation first = memoryManager.allocate(0, 3);
+    ShardedMemoryManager::Allocation second = memoryManager.allocate(1, 2);
+    // Steals from the second shard.
+    ShardedMemoryManager::Allocation third = memoryManager.allocate(0, 2);
+    ShardedMemoryManager::Allocation fourth = memoryManager.allocate(0, 2);
+    vector<MemorySize> offsets{first.offset, second.offset, third.offset, fourth.offset};
+    CheckResult(8, offsets, vector<MemorySize>{1, 5, 7, -1}, "ShardedMemoryManager allocate");
+
+    memoryManager.revoke(first.handle);
+    memoryManager.revoke(third.handle);
+    offsets = {memoryManager.allocate(1, 4).offset, memoryManager.allocate(1, 2).offset};
+    CheckResult(8, offsets, vector<MemorySize>{1, 7}, "ShardedMemoryManager revoke");
+
+    vector<MemorySize> boundaries{ProportionalCells(MAX_MEMORY_SIZE, 3, 1 << 20),
+                                  ProportionalCells(MAX_MEMORY_SIZE, (1 << 20) - 1, 1 << 20),
+                                  ProportionalCells(MAX_MEMORY_SIZE, 1 << 20, 1 << 20)};
+    CheckResult(MAX_MEMORY_SIZE, boundaries,
+                vector<MemorySize>{402653183, 140737354137599, MAX_MEMORY_SIZE},
+                "ProportionalCells");
+
+    ShardedMemoryManager single(4, 0);
+    offsets = {MemorySize(single.shardsCount()), single.allocate(3, 4).offset};
+    CheckResult(4, offsets, vector<MemorySize>{1, 1}, "ShardedMemoryManager with zero shards");
+
+    MpscQueue<int> queue(4);
+    vector<int> popped;
+    for (int i = 0; i < 5; ++i) {
+        popped.push_back(queue.push(i));
+    }
+    int value;
+    while (queue.pop(value)) {
+        popped.push_back(value);
     }
+    CheckResult(4, popped, vector<int>{1, 1, 1, 1, 0, 0, 1, 2, 3}, "MpscQueue");
+
+    RunStressTest("StressTestShardedMemoryManager", 07012014, 10, [&] {
+        StressTestShardedMemoryManager(4, 20000);
+    }, 1);
 }
 
-void TestHeapInsertAll() {
-    TestHeapInsert(vector<int>{1, 2, 3, 4, 5}, 6);
-    TestHeapInsert(vector<int>{5, 4, 3, 2, 1}, 0);
-    TestHeapInsert(vector<int>{3, 8, 2, 1, 4}, 5);
-    TestHeapInsert(vector<int>{5, 5, 5, 5, 5}, 5);
+// Allocates random blocks from a small buffer until it is exhausted and
+// revokes random ones, checking that the live blocks are aligned, lie in the
+// buffer and do not overlap.
+void StressTestBufferMemoryResource(int maxRequestsCount) {
+    const size_t bufferSize = 4096;
+    vector<unsigned char> buffer(bufferSize + 1);
+    // Unaligned on purpose.
+    unsigned char* begin = buffer.data() + 1;
+    BufferMemoryResource<> resource(begin, bufferSize);
 
-    srand(07012014);
-    const size_t smallTestCount = 1000;
-    for (size_t testNum = 1; testNum <= smallTestCount; ++testNum) {
-        cout << "Test " << testNum << endl;
-        StressTestInsert(10, 10, 1);
+    struct Block {
+        unsigned char* pointer;
+        size_t size;
+        size_t alignment;
+        unsigned char pattern;
+    };
+    vector<Block> live;
+    const vector<size_t> alignments{1, 8, 16, 64, 256};
+    int requestsCount = Random(1, maxRequestsCount);
+    for (int request = 0; request < requestsCount; ++request) {
+        if (live.empty() || Random(0, 2) > 0) {
+            Block block;
+            block.size = Random(0, 300);
+            block.alignment = alignments[Random(0, alignments.size() - 1)];
+            block.pattern = static_cast<unsigned char>(request);
+            try {
+                block.pointer = static_cast<unsigned char*>(
+                    resource.allocate(block.size, block.alignment));
+            } catch (const std::bad_alloc&) {
+                continue;
+            }
+            uintptr_t address = reinterpret_cast<uintptr_t>(block.pointer);
+            bool isValid = address % block.alignment == 0 && block.pointer >= begin &&
+                           block.pointer + block.size <= begin + bufferSize;
+            CheckResult(block.size, isValid, true, "BufferMemoryResource allocate");
+            std::memset(block.pointer, block.pattern, block.size);
+            live.push_back(block);
+        } else {
+            size_t position = Random(0, live.size() - 1);
+            const Block& block = live[position];
+            bool isIntact = std::count(block.pointer, block.pointer + block.size, block.pattern) ==
+                            std::ptrdiff_t(block.size);
+            CheckResult(block.size, isIntact, true, "BufferMemoryResource overlapping blocks");
+            resource.deallocate(block.pointer, block.size, block.alignment);
+            live[position] = live.back();
+            live.pop_back();
+        }
+        CheckResult(request, resource.blocksCount(), live.size(), "BufferMemoryResource blocksCount");
+    }
+    for (size_t i = 0; i < live.size(); ++i) {
+        resource.deallocate(live[i].pointer, live[i].size, live[i].alignment);
+    }
+    // All the blocks are merged back.
+    void* whole = resource.allocate(bufferSize - BufferMemoryResource<>::GRANULE);
+    resource.deallocate(whole, bufferSize - BufferMemoryResource<>::GRANULE);
+}
+
+void TestBufferMemoryResourceAll() {
+    BufferMemoryResource<> resource(1 << 16);
+    {
+        std::pmr::vector<int> numbers(&resource);
+        for (int i = 0; i < 1000; ++i) {
+            numbers.push_back(i);
+        }
+        CheckResult(1000, std::accumulate(numbers.begin(), numbers.end(), 0), 499500,
+                    "std::pmr::vector over BufferMemoryResource");
     }
+    CheckResult(0, resource.blocksCount(), size_t(0), "BufferMemoryResource release");
 
-    const size_t bigTestCount = 1000;
-    for (size_t testNum = smallTestCount + 1; testNum <= bigTestCount; ++testNum) {
-        cout << "Test " << testNum << endl;
-        StressTestInsert(100, 1000, 10);
+    bool isExhausted = false;
+    try {
+        resource.deallocate(resource.allocate(1 << 17), 1 << 17);
+    } catch (const std::bad_alloc&) {
+        isExhausted = true;
     }
+    CheckResult(1 << 17, isExhausted, true, "BufferMemoryResource exhaustion");
+
+    BufferMemoryResource<> other(1 << 12);
+    vector<bool> equalities{resource == resource, resource == other};
+    CheckResult(0, equalities, vector<bool>{true, false}, "BufferMemoryResource is_equal");
+
+    RunStressTest("StressTestBufferMemoryResource", 07012014, 100, [&] {
+        StressTestBufferMemoryResource(1000);
+    });
 }
 
-void TestHeapRemove(const vector<int>& currentHeap, int positionForRemove) {
-    Heap<int> heap(currentHeap);
-    heap.remove(positionForRemove);
-    CheckHeap(currentHeap, heap, "remove");
+void TestBuddyMemoryManage(int size, const vector<int>& rawRequests, const vector<int>& answers) {
+    BuddyMemoryManager manager(size);
+    CheckResult(rawRequests, ProcessRawRequests(manager, rawRequests),
+                vector<MemorySize>(answers.begin(), answers.end()), "BuddyMemoryManager");
 }
 
-void StressTestRemove(int maxLength, int maxItemAbs, int maxRemovalCount) {
-    vector<int> input = RandomVector(maxLength, maxItemAbs);
+// Checks that the buddy allocations are aligned, stay inside the memory
+// and never overlap, and that the memory is merged back after revoking
+// everything.
+void StressTestBuddyMemoryManage(int maxSize, int maxRequestsCount) {
+    int size = Random(1, maxSize);
+    vector<int> rawRequests = RandomRawRequests(size, maxRequestsCount);
+    BuddyMemoryManager manager(size);
 
-    int insertionsCount = Random(0, maxRemovalCount);
-    for (size_t testNum = 1; testNum <= insertionsCount; ++testNum) {
-        int position = Random(0, maxItemAbs);
-        TestHeapRemove(input, position);
+    vector<int> owners(size + 1, NO_OPERATION);
+    vector<int> liveRequests;
+    for (size_t i = 0; i < rawRequests.size(); ++i) {
+        int requestId = i + 1;
+        if (rawRequests[i] < 0) {
+            manager.revoke(-rawRequests[i]);
+            for (int cell = 1; cell <= size; ++cell) {
+                if (owners[cell] == -rawRequests[i]) {
+                    owners[cell] = NO_OPERATION;
+                }
+            }
+            continue;
+        }
+
+        int offset = manager.allocate(rawRequests[i]);
+        if (offset == FAIL_CODE) {
+            continue;
+        }
+        int blockSize = 1;
+        while (blockSize < rawRequests[i]) {
+            blockSize *= 2;
+        }
+        bool correct = (offset - 1) % blockSize == 0 && offset + blockSize - 1 <= size;
+        for (int cell = offset; correct && cell < offset + blockSize; ++cell) {
+            correct = owners[cell] == NO_OPERATION;
+            owners[cell] = requestId;
+        }
+        CheckResult(rawRequests, correct, true, "BuddyMemoryManager allocate");
+        liveRequests.push_back(requestId);
     }
+
+    for (size_t i = 0; i < liveRequests.size(); ++i) {
+        manager.revoke(liveRequests[i]);
+    }
+    int largestBlock = 1;
+    while (largestBlock * 2 <= size) {
+        largestBlock *= 2;
+    }
+    CheckResult(rawRequests, manager.allocate(largestBlock), 1, "BuddyMemoryManager revoke");
 }
 
-void TestHeapRemoveAll() {
-    TestHeapRemove(vector<int>{1, 2, 3, 4, 5}, 3);
-    TestHeapRemove(vector<int>{1, 2, 3, 4, 5}, -3);
-    TestHeapRemove(vector<int>{1, 2, 3, 4, 5}, 10);
-    TestHeapRemove(vector<int>{3, 8, 2, 1, 4}, 1);
-    TestHeapRemove(vector<int>{5, 5, 5, 5, 5}, 2);
+void TestBuddyMemoryManageAll() {
+    TestBuddyMemoryManage(8, vector<int>{3, 1, 2, 1, -1, 4}, vector<int>{1, 5, 7, 6, 1});
+    TestBuddyMemoryManage(6, vector<int>{4, 2, 1}, vector<int>{1, 5, -1});
+    TestBuddyMemoryManage(5, vector<int>{5, 4, 1, 1}, vector<int>{-1, 1, 5, -1});
+    TestBuddyMemoryManage(16, vector<int>{1, 1, 1, 1, -1, -2, -3, -4, 16},
+                          vector<int>{1, 2, 3, 4, 1});
+    // Grows in place, shrinks in place, grows two orders in place, can't grow
+    // the upper half or move.
+    const int R = REALLOCATION_CODE;
+    TestBuddyMemoryManage(8, vector<int>{2, R, 1, 4, 1, R, 1, 1, R, 3, 4, R, 1, 4, R, 3, 8,
+                                         -1, R, 3, 8, R, 3, 2, 4},
+                          vector<int>{1, 1, 5, 1, 5, 1, -1, -1, 5, 1});
+    // A negative size fails and keeps the block, like in `MemoryManager`.
+    const vector<int> negativeRequests{2, R, 1, -1, 2};
+    TestBuddyMemoryManage(4, negativeRequests, vector<int>{1, -1, 3});
+    TestMemoryManage(4, negativeRequests, vector<int>{1, -1, 3});
 
-    srand(07012014);
-    const size_t smallTestCount = 1000;
-    for (size_t testNum = 1; testNum <= smallTestCount; ++testNum) {
-        cout << "Test " << testNum << endl;
-        StressTestRemove(10, 10, 1);
+    HierarchicalBitmap bitmap(100000);
+    bitmap.set(99999);
+    bitmap.set(4097);
+    CheckResult(4097, bitmap.findFirst(), size_t(4097), "HierarchicalBitmap");
+    bitmap.reset(4097);
+    CheckResult(99999, bitmap.findFirst(), size_t(99999), "HierarchicalBitmap");
+    bitmap.reset(99999);
+    CheckResult(0, bitmap.any(), false, "HierarchicalBitmap");
+
+    const size_t testCount = 1000;
+    RunStressTest("StressTestBuddyMemoryManage", 07012014, testCount, [&] {
+        StressTestBuddyMemoryManage(100, 50);
+    });
+}
+
+void TestInputReader(const string& input, const vector<int>& expected) {
+    InputReader reader(input.data(), input.data() + input.size());
+    vector<int> result;
+    int value;
+    while (reader.readInt(value)) {
+        result.push_back(value);
     }
+    CheckResult(input, result, expected, "InputReader");
+}
 
-    const size_t bigTestCount = 1000;
-    for (size_t testNum = smallTestCount + 1; testNum <= bigTestCount; ++testNum) {
-        cout << "Test " << testNum << endl;
-        StressTestRemove(100, 1000, 10);
+
+// Returns the text written by `write` to an `OutputWriter`.
+template <class Writing>
+string WrittenText(Writing write) {
+    FILE* file = std::tmpfile();
+    {
+        OutputWriter writer(file);
+        write(writer);
     }
+
+    std::rewind(file);
+    string result;
+    int symbol;
+    while ((symbol = std::fgetc(file)) != EOF) {
+        result.push_back(symbol);
+    }
+    std::fclose(file);
+    return result;
 }
 
-void TestHeapAll() {
-    cout << "Testing single parameter constructor of the Heap" << endl;
-    TestHeapConstructorAll();
+// Compares the output of `ProcessRequestsPipelined` and `ProcessRequests`.
+void TestProcessRequestsPipelined(int size, const vector<int>& rawRequests) {
+    string input;
+    for (size_t i = 0; i < rawRequests.size(); ++i) {
+        input += std::to_string(rawRequests[i]) + ' ';
+    }
 
-    cout << "Testing insert of the Heap" << endl;
-    TestHeapInsertAll();
+    string expected = WrittenText([&](OutputWriter& output) {
+        MemoryManager<> manager(size);
+        InputReader reader(input.data(), input.data() + input.size());
+        ProcessRequests(manager, rawRequests.size(), reader, output);
+    });
+    string result = WrittenText([&](OutputWriter& output) {
+        MemoryManager<> manager(size);
+        InputReader reader(input.data(), input.data() + input.size());
+        ProcessRequestsPipelined(manager, rawRequests.size(), reader, output);
+    });
 
-    cout << "Testing remove of the Heap" << endl;
-    TestHeapRemoveAll();
+    CheckResult(rawRequests, result, expected, "ProcessRequestsPipelined");
 }
 
-void TestMemoryManage(int size, const vector<int>& rawRequests, const vector<int>& answers) {
-    MemoryManager manager(size);
-    vector<int> results;
-    results.reserve(rawRequests.size());
+void StressTestProcessRequestsPipelined(int maxSize, int maxRequestsCount) {
+    int size = Random(1, maxSize);
+    TestProcessRequestsPipelined(size, RandomRawRequests(size, maxRequestsCount));
+}
 
-    for (int i = 0; i < rawRequests.size(); ++i) {
-        Request* request;
-        if (rawRequests[i] >= 0) {
-            request = new AllocationRequest(rawRequests[i]);
-        } else {
-            request = new RevocationRequest(-rawRequests[i]);
-        }
-        int result = processRequest(manager, *request);
-        if (request->type() == ALLOCATION) {
-            results.push_back(result);
+void TestProcessRequestsPipelinedAll() {
+    SpscQueue<int> queue(2);
+    vector<int> pushed{queue.push(1), queue.push(2), queue.push(3)};
+    CheckResult(2, pushed, vector<int>{1, 1, 0}, "SpscQueue push");
+    vector<int> popped{queue.popWaiting(), queue.popWaiting()};
+    CheckResult(2, popped, vector<int>{1, 2}, "SpscQueue pop");
+
+    // Every batch goes round the queues several times.
+    vector<int> rawRequests;
+    for (size_t i = 1; i <= 3 * PIPELINE_BATCHES_COUNT * REQUESTS_BATCH_SIZE + 1; ++i) {
+        rawRequests.push_back(i % 2 == 1 ? 1 : -int(i - 1));
+    }
+    TestProcessRequestsPipelined(1, rawRequests);
+
+    const size_t testCount = 100;
+    RunStressTest("StressTestProcessRequestsPipelined", 07012014, testCount, [&] {
+        StressTestProcessRequestsPipelined(1000, 50000);
+    }, 1);
+}
+
+void TestOutputWriter(const vector<int>& input, const string& expected) {
+    string result = WrittenText([&](OutputWriter& writer) {
+        for (size_t i = 0; i < input.size(); ++i) {
+            writer.writeLine(input[i]);
         }
+    });
+    CheckResult(input, result, expected, "OutputWriter");
+}
+
+// Returns the path of a new temporary file with the `content`.
+string TemporaryFile(const string& content) {
+    char path[] = "/tmp/memory_manager_XXXXXX";
+    int descriptor = mkstemp(path);
+    if (descriptor < 0 || write(descriptor, content.data(), content.size()) != ssize_t(content.size())) {
+        throw runtime_error("can't create a temporary file");
     }
+    close(descriptor);
+    return path;
+}
 
-    CheckResult(rawRequests, results, answers, "processRequest");
+// Returns the requests of the trace file, empty if it is broken.
+vector<int> TraceRequests(const string& path, MemorySize& memorySize) {
+    MappedFile file(path);
+    Trace trace;
+    if (!ReadTrace(file, trace)) {
+        return vector<int>();
+    }
+    memorySize = trace.memorySize;
+    return vector<int>(trace.requests, trace.requests + trace.count);
+}
+
+void TestTraceAll() {
+    const string text = "6 8\n2 3 -1 3 3 -5 2 2\n";
+    const vector<int> requests{2, 3, -1, 3, 3, -5, 2, 2};
+    string textPath = TemporaryFile(text);
+    string binaryPath = TemporaryFile("");
+    string brokenPath = TemporaryFile("6 9\n2 3 -1");
+
+    MemorySize memorySize = 0;
+    CheckResult(text, TraceRequests(textPath, memorySize), requests, "ReadTrace of a text trace");
+    CheckResult(text, memorySize, MemorySize(6), "ReadTrace of a text trace");
+
+    CheckResult(text, ConvertTrace(textPath, binaryPath), true, "ConvertTrace");
+    memorySize = 0;
+    CheckResult(text, TraceRequests(binaryPath, memorySize), requests, "ReadTrace of a binary trace");
+    CheckResult(text, memorySize, MemorySize(6), "ReadTrace of a binary trace");
+
+    const string largeText = "1099511627776 1\n7\n";
+    string largePath = TemporaryFile(largeText);
+    CheckResult(largeText, ConvertTrace(largePath, binaryPath), true, "ConvertTrace");
+    CheckResult(largeText, TraceRequests(binaryPath, memorySize), vector<int>{7},
+                "ReadTrace of a large binary trace");
+    CheckResult(largeText, memorySize, MemorySize(1) << 40, "ReadTrace of a large binary trace");
+    unlink(largePath.c_str());
+
+    CheckResult(text, TraceRequests(brokenPath, memorySize), vector<int>(), "ReadTrace of a broken trace");
+
+    const string reallocationText = "10 4\n3 @1 5 4\n@ 4 1\n";
+    string reallocationPath = TemporaryFile(reallocationText);
+    CheckResult(reallocationText, TraceRequests(reallocationPath, memorySize),
+                vector<int>{3, REALLOCATION_CODE, 1, 5, 4, REALLOCATION_CODE, 4, 1},
+                "ReadTrace of a trace with reallocations");
+    unlink(reallocationPath.c_str());
+    CheckResult(text, MappedFile("/nonexistent/trace").valid(), false, "MappedFile of a missing file");
+
+    unlink(textPath.c_str());
+    unlink(binaryPath.c_str());
+    unlink(brokenPath.c_str());
+
+    vector<uint32_t> latencies{5, 1, 4, 2, 3};
+    vector<uint32_t> percentiles{Percentile(latencies, 0), Percentile(latencies, 0.5),
+                                 Percentile(latencies, 1)};
+    CheckResult(5, percentiles, vector<uint32_t>{1, 3, 5}, "Percentile");
+}
+
+void TestInputOutputAll() {
+    TestInputReader("6 8\n2 3 -1 3 3 -5 2 2\n", vector<int>{6, 8, 2, 3, -1, 3, 3, -5, 2, 2});
+    TestInputReader("  \t-0\r\n2147483647 -2147483647", vector<int>{0, 2147483647, -2147483647});
+    TestInputReader("", vector<int>{});
+    TestInputReader(" \n ", vector<int>{});
+    TestInputReader("-2147483648 2147483647", vector<int>{-2147483647 - 1, 2147483647});
+    TestInputReader("1 2 x 3", vector<int>{1, 2});
+    TestInputReader("1 - 2", vector<int>{1});
+    TestInputReader("1 2147483648", vector<int>{1});
+    TestInputReader("-2147483649", vector<int>{});
+
+    TestOutputWriter(vector<int>{1, -1, 0, 2147483647, -2147483647 - 1},
+                     "1\n-1\n0\n2147483647\n-2147483648\n");
+    CheckResult(MAX_MEMORY_SIZE, WrittenText([](OutputWriter& writer) {
+                    writer.writeLine(MAX_MEMORY_SIZE);
+                    writer.writeLine(std::numeric_limits<int64_t>::min());
+                }),
+                string("140737488355327\n-9223372036854775808\n"), "OutputWriter of 64-bit values");
+
+    string large = "140737488355327 -4294967296";
+    InputReader reader(large.data(), large.data() + large.size());
+    vector<int64_t> values(2);
+    reader.readInt(values[0]);
+    reader.readInt(values[1]);
+    CheckResult(large, values, vector<int64_t>{MAX_MEMORY_SIZE, -(int64_t(1) << 32)},
+                "InputReader of 64-bit values");
+
+    string limits = "9223372036854775807 -9223372036854775808 9223372036854775808 1";
+    InputReader limitsReader(limits.data(), limits.data() + limits.size());
+    values.clear();
+    int64_t value;
+    while (limitsReader.readInt(value)) {
+        values.push_back(value);
+    }
+    CheckResult(limits, values,
+                vector<int64_t>{std::numeric_limits<int64_t>::max(),
+                                std::numeric_limits<int64_t>::min()},
+                "InputReader of the 64-bit limits");
+
+    // The number equal to `REALLOCATION_CODE` stops the requests like
+    // a malformed one instead of taking the next two as its arguments.
+    string withCode = "3 -2147483648 2 4";
+    string processed = WrittenText([&withCode](OutputWriter& output) {
+        MemoryManager<> manager(10);
+        InputReader input(withCode.data(), withCode.data() + withCode.size());
+        ProcessRequests(manager, 4, input, output);
+    });
+    CheckResult(withCode, processed, string("1\n"), "ProcessRequests of REALLOCATION_CODE");
+
+    // More than the buffer size.
+    string lines;
+    for (int i = 0; i < 20000; ++i) {
+        lines += "-1\n";
+    }
+    TestOutputWriter(vector<int>(20000, -1), lines);
+
+    TestTraceAll();
+}
+
+// Revokes many live allocations in a scattered order,
+// so the operations table is rehashed and its slots are reused.
+void TestMemoryManageManyOperations() {
+    const int allocationsCount = 1000;
+    vector<int> rawRequests;
+    vector<int> answers;
+    for (int i = 1; i <= allocationsCount; ++i) {
+        rawRequests.push_back(1);
+        answers.push_back(i);
+    }
+    for (int i = 1; i <= allocationsCount; i += 2) {
+        rawRequests.push_back(-i);
+    }
+    for (int i = allocationsCount; i >= 1; i -= 2) {
+        rawRequests.push_back(-i);
+    }
+    rawRequests.push_back(allocationsCount);
+    answers.push_back(1);
+
+    TestMemoryManage(allocationsCount, rawRequests, answers);
+}
+
+// Manages more cells than fit in 32 bits, so the offsets and the sizes
+// of the parts above 2^32 must survive the packing of `MemoryPart`.
+void TestMemoryManageLarge() {
+    const MemorySize block = MemorySize(1) << 35;
+    MemoryManager<> manager(MemorySize(1) << 40);
+    vector<MemorySize> offsets{manager.allocate(block), manager.allocate(block),
+                               manager.allocate(block)};
+    manager.revoke(2);
+    offsets.push_back(manager.reallocate(1, 2 * block));
+    offsets.push_back(manager.allocate((MemorySize(1) << 40) - 3 * block));
+    offsets.push_back(manager.allocate(1));
+    CheckResult(block, offsets, vector<MemorySize>{1, block + 1, 2 * block + 1, 1, 3 * block + 1, -1},
+                "MemoryManager of 2^40 cells");
+
+    bool thrown = false;
+    try {
+        MemoryManager<> tooLarge(MAX_MEMORY_SIZE + 1);
+    } catch (const std::length_error&) {
+        thrown = true;
+    }
+    CheckResult(MAX_MEMORY_SIZE + 1, thrown, true, "MemoryManager beyond MAX_MEMORY_SIZE");
+    CheckResult(block, manager.allocate(-1), FAIL_CODE, "allocate of a negative size");
 }
 
 void TestMemoryManageAll() {
@@ -650,9 +5930,57 @@ void TestMemoryManageAll() {
     TestMemoryManage(6, vector<int>{6, -1, 6, -3, 6}, vector<int>{1, 1, 1});
     TestMemoryManage(6, vector<int>{-3, -2, -1, 4, 2, 1}, vector<int>{1, 5, -1});
     TestMemoryManage(6, vector<int>{2, 3, -1, 3, 3, -5, 2, 2}, vector<int>{1, 3, -1, -1, 1, -1});
+    TestMemoryManage(6, vector<int>{3, 3, -1, -1, -3, 6}, vector<int>{1, 4, -1});
+    TestMemoryManageManyOperations();
+    TestMemoryManageLarge();
+
+    const size_t testCount = 1000;
+    RunStressTest("StressTestMemoryManage", 07012014, testCount, [&] {
+        StressTestMemoryManage(50, 50);
+    });
+}
+
+void TestPlacementsAll() {
+    // Free parts are [1, 3], [5, 6] and [8, 14] before the last two allocations.
+    const vector<int> rawRequests{3, 1, 2, 1, 4, -1, -3, -5, 1, 2};
+    TestMemoryManage<WorstFitPlacement>(14, rawRequests, vector<int>{1, 4, 5, 7, 8, 8, 9});
+    TestMemoryManage<BestFitPlacement>(14, rawRequests, vector<int>{1, 4, 5, 7, 8, 5, 1});
+    TestMemoryManage<FirstFitPlacement>(14, rawRequests, vector<int>{1, 4, 5, 7, 8, 1, 2});
+    TestMemoryManage<NextFitPlacement>(14, rawRequests, vector<int>{1, 4, 5, 7, 8, 1, 2});
+
+    // Free parts are [1, 2] and [7, 10] before the last two allocations.
+    const vector<int> wrapRequests{2, 2, 2, -1, 1, 1};
+    TestMemoryManage<WorstFitPlacement>(10, wrapRequests, vector<int>{1, 3, 5, 7, 8});
+    TestMemoryManage<BestFitPlacement>(10, wrapRequests, vector<int>{1, 3, 5, 1, 2});
+    TestMemoryManage<FirstFitPlacement>(10, wrapRequests, vector<int>{1, 3, 5, 1, 2});
+    TestMemoryManage<NextFitPlacement>(10, wrapRequests, vector<int>{1, 3, 5, 7, 8});
+
+    TestFreePartNeighbours();
+
+    const size_t testCount = 1000;
+    RunStressTest("StressTestMemoryManage", 07012014, testCount, [&] {
+        StressTestMemoryManage<BestFitPlacement>(50, 50, "best-fit");
+        StressTestMemoryManage<FirstFitPlacement>(50, 50, "first-fit");
+        StressTestMemoryManage<NextFitPlacement>(50, 50, "next-fit");
+        StressTestFreeMemoryParts(50, 50);
+    });
 }
 
 void TestAll() {
     TestHeapAll();
-    TestMemoryManageAll();
+    RunTestSuite("MemoryManager", TestMemoryManageAll);
+    RunTestSuite("placement policies", TestPlacementsAll);
+    RunTestSuite("size classes", TestSizeClassesAll);
+    RunTestSuite("reallocate", TestReallocateAll);
+    RunTestSuite("compaction", TestCompactionAll);
+    RunTestSuite("stats", TestStatsAll);
+    RunTestSuite("snapshots", TestSnapshotAll);
+    RunTestSuite("deferred merging", TestDeferredMergingAll);
+    RunTestSuite("BuddyMemoryManager", TestBuddyMemoryManageAll);
+    RunTestSuite("InputReader and OutputWriter", TestInputOutputAll);
+    RunTestSuite("batch processing", TestProcessBatchAll);
+    RunTestSuite("workload generators", TestWorkloadGeneratorAll);
+    RunTestSuite("ShardedMemoryManager", TestShardedMemoryManagerAll);
+    RunTestSuite("BufferMemoryResource", TestBufferMemoryResourceAll);
+    RunTestSuite("pipelined processing", TestProcessRequestsPipelinedAll);
 }
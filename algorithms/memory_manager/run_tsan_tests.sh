@@ -0,0 +1,14 @@
+#!/bin/sh
+# Builds the memory manager with ThreadSanitizer and runs its `--test`
+# mode. The sharded and pipelined tests start threads of their own,
+# and the stress tests run on the threads of the harness.
+# Extra arguments go to `--test`, e.g. `--test-threads 2`.
+set -e
+
+source_dir=$(cd "$(dirname "$0")" && pwd)
+binary=$(mktemp "${TMPDIR:-/tmp}/memory_manager_tsan.XXXXXX")
+trap 'rm -f "$binary"' EXIT
+
+${CXX:-g++} -std=c++17 -O1 -g -fsanitize=thread -pthread \
+    -o "$binary" "$source_dir/memory_namager.cpp"
+TSAN_OPTIONS="halt_on_error=1 ${TSAN_OPTIONS}" "$binary" --test "$@"
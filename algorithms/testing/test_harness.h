@@ -0,0 +1,166 @@
+// Quiet test harness shared by the `--test` modes of the `algorithms/`
+// programs. The iterations of a stress test run silently on several
+// threads. Every iteration seeds the generator of its thread by the seed
+// of the test and its own index, so the results don't depend on the
+// number of threads or on the order of the iterations. A failed iteration
+// is reported with its seed, and `--test-seed <seed>` reruns every stress
+// test once with that seed. `--test-iterations <count>` caps the
+// iterations of every stress test for a quick run.
+#ifndef ALGORITHMS_TESTING_TEST_HARNESS_H
+#define ALGORITHMS_TESTING_TEST_HARNESS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct TestHarnessSettings {
+    // Zero for the number of the hardware threads.
+    size_t threadsCount;
+    // Zero for the iterations asked by every stress test.
+    size_t maxIterationsCount;
+    // If set, every stress test runs one iteration with `replayedSeed`.
+    bool replaying;
+    uint64_t replayedSeed;
+
+    TestHarnessSettings()
+        : threadsCount(0),
+          maxIterationsCount(0),
+          replaying(false),
+          replayedSeed(0)
+    {}
+};
+
+inline TestHarnessSettings& TestSettings() {
+    static TestHarnessSettings settings;
+    return settings;
+}
+
+// Parses the options of the harness in `argv[first]`, ...:
+// `--test-seed <seed>`, `--test-threads <count>` and `--test-iterations <count>`.
+// Returns `false` if there is anything else.
+inline bool ParseTestArguments(int argc, char* argv[], int first) {
+    for (int i = first; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "--test-seed" && i + 1 < argc) {
+            TestSettings().replaying = true;
+            TestSettings().replayedSeed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (argument == "--test-threads" && i + 1 < argc) {
+            TestSettings().threadsCount = std::strtoull(argv[++i], nullptr, 10);
+        } else if (argument == "--test-iterations" && i + 1 < argc) {
+            TestSettings().maxIterationsCount = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The generator of the current thread, seeded before every iteration.
+inline std::mt19937_64& TestGenerator() {
+    thread_local std::mt19937_64 generator(1);
+    return generator;
+}
+
+// Returns a random number from the range [rangeMin, rangeMax].
+inline int Random(int rangeMin, int rangeMax) {
+    return std::uniform_int_distribution<int>(rangeMin, rangeMax)(TestGenerator());
+}
+
+// Mixes the seed of a stress test with the index of an iteration (splitmix64).
+inline uint64_t IterationSeed(uint64_t testSeed, uint64_t iteration) {
+    uint64_t seed = testSeed + (iteration + 1) * 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    return seed ^ (seed >> 31);
+}
+
+// Calls `iteration` `iterationsCount` times on up to `maxThreadsCount`
+// threads (zero for no limit), so it must be safe to call concurrently.
+// After a failure no new iterations start, and the failure of the smallest
+// index is reported to `std::cerr` with its seed and rethrown.
+template <class Iteration>
+void RunStressTest(const std::string& name, uint64_t testSeed, size_t iterationsCount,
+                   Iteration iteration, size_t maxThreadsCount = 0) {
+    if (TestSettings().replaying) {
+        if (iterationsCount > 0) {
+            TestGenerator().seed(TestSettings().replayedSeed);
+            iteration();
+        }
+        return;
+    }
+
+    if (TestSettings().maxIterationsCount > 0) {
+        iterationsCount = std::min(iterationsCount, TestSettings().maxIterationsCount);
+    }
+
+    size_t threadsCount = TestSettings().threadsCount;
+    if (threadsCount == 0) {
+        threadsCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    if (maxThreadsCount > 0) {
+        threadsCount = std::min(threadsCount, maxThreadsCount);
+    }
+    threadsCount = std::min(threadsCount, iterationsCount);
+
+    std::atomic<size_t> nextIteration(0);
+    std::atomic<bool> failed(false);
+    std::mutex failureMutex;
+    size_t failedIteration = iterationsCount;
+    std::exception_ptr failure;
+
+    auto work = [&] {
+        while (!failed) {
+            size_t index = nextIteration++;
+            if (index >= iterationsCount) {
+                return;
+            }
+            TestGenerator().seed(IterationSeed(testSeed, index));
+            try {
+                iteration();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(failureMutex);
+                if (index < failedIteration) {
+                    failedIteration = index;
+                    failure = std::current_exception();
+                }
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t thread = 1; thread < threadsCount; ++thread) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (size_t thread = 0; thread < threads.size(); ++thread) {
+        threads[thread].join();
+    }
+
+    if (failure) {
+        std::cerr << name << " failed at iteration " << failedIteration << " with the seed "
+                  << IterationSeed(testSeed, failedIteration) << ", rerun it with --test-seed "
+                  << IterationSeed(testSeed, failedIteration) << std::endl;
+        std::rethrow_exception(failure);
+    }
+}
+
+// Runs `suite` and prints its wall time.
+template <class Suite>
+void RunTestSuite(const std::string& name, Suite suite) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    suite();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << uint64_t(elapsed.count()) << " ms" << std::endl;
+}
+
+#endif  // ALGORITHMS_TESTING_TEST_HARNESS_H